@@ -1,5 +1,17 @@
 #include <string>
 
+#include "FileOperations.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 using namespace std;
 ///
 /// This file will handle file operations such as checking for compatibility of files, 
@@ -7,12 +19,221 @@ using namespace std;
 /// 
 /// 
 
+MappedFile::MappedFile()
+{
+	data = NULL;
+	size = 0;
+	readAheadEnd = 0;
+	releasedEnd = 0;
+	open = false;
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	pageSize = info.dwAllocationGranularity;
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+#else
+	pageSize = sysconf(_SC_PAGESIZE);
+	file = -1;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+// map the whole file read-only, hinting that it will be read once from start to end
+
+bool MappedFile::Open(const char fileName[])
+{
+	Close();
+#ifdef _WIN32
+	file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize))
+	{
+		Close();
+		return false;
+	}
+	size = fileSize.QuadPart;
+	if (size > 0)
+	{
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+			data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!data)
+		{
+			Close();
+			return false;
+		}
+	}
+#else
+	file = ::open(fileName, O_RDONLY);
+	if (file < 0)
+		return false;
+	struct stat status;
+	if (fstat(file, &status) != 0 || !S_ISREG(status.st_mode))
+	{
+		Close();
+		return false;
+	}
+	size = status.st_size;
+	if (size > 0)
+	{
+		void* mapped = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, file, 0);
+		if (mapped == MAP_FAILED)
+		{
+			Close();
+			return false;
+		}
+		data = (const unsigned char*)mapped;
+		madvise(mapped, (size_t)size, MADV_SEQUENTIAL);
+	}
+#endif
+	open = true;
+	ReadAhead(0);
+	return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if (data)
+		munmap((void*)data, (size_t)size);
+	if (file >= 0)
+		::close(file);
+	file = -1;
+#endif
+	data = NULL;
+	size = 0;
+	readAheadEnd = 0;
+	releasedEnd = 0;
+	open = false;
+}
 
+bool MappedFile::IsOpen() const
+{
+	return open;
+}
+
+long long MappedFile::GetSize() const
+{
+	return size;
+}
+
+const unsigned char* MappedFile::GetData() const
+{
+	return data;
+}
+
+// call with the send position as it advances
+//  + read-ahead is requested a quarter window at a time, so most calls make no system call at all
+
+void MappedFile::ReadAhead(long long offset)
+{
+	if (!data)
+		return;
+	const long long step = ReadAheadSize / 4;
+	const long long end = offset + ReadAheadSize < size ? offset + ReadAheadSize : size;
+	if (end - readAheadEnd >= step || (end == size && readAheadEnd < size))
+	{
+		const long long start = readAheadEnd / pageSize * pageSize;
+#ifdef _WIN32
+#if _WIN32_WINNT >= 0x0602
+		WIN32_MEMORY_RANGE_ENTRY range;
+		range.VirtualAddress = (PVOID)(data + start);
+		range.NumberOfBytes = (SIZE_T)(end - start);
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#endif
+#else
+		madvise((void*)(data + start), (size_t)(end - start), MADV_WILLNEED);
+#endif
+		readAheadEnd = end;
+	}
+}
+
+// ask for the window past offset again, when IsResident still fails after read-ahead was requested for it
+//  + the kernel may drop read-ahead pages under memory pressure before they are used, and ReadAhead never asks for a
+//    range twice
+
+void MappedFile::Refetch(long long offset)
+{
+	if (readAheadEnd > offset)
+		readAheadEnd = offset;
+	ReadAhead(offset);
+}
+
+// let go of the pages before keep, call with the oldest offset still needed, i.e. the oldest unacked payload
+//  + release happens a quarter window at a time like read-ahead, and the tail goes once keep reaches the end. it
+//    touches no state ReadAhead and Refetch do, so they may be called from different threads
+//  + windows keeps the whole mapping, the pages are reclaimed under memory pressure as they are read-only
+
+void MappedFile::Release(long long keep)
+{
+	if (!data)
+		return;
+#ifndef _WIN32
+	const long long step = ReadAheadSize / 4;
+	const long long behind = keep < size ? keep / pageSize * pageSize : size;
+	if (behind - releasedEnd >= step || (behind == size && releasedEnd < size))
+	{
+		madvise((void*)(data + releasedEnd), (size_t)(behind - releasedEnd), MADV_DONTNEED);
+		releasedEnd = behind;
+	}
+#else
+	(void)keep;
+#endif
+}
+
+// true if every page of the range is in memory, so reading it cannot block on the disk
+//  + windows has no cheap residency query, there we rely on the prefetch and always say yes
+
+bool MappedFile::IsResident(long long offset, int bytes) const
+{
+	if (!data || bytes <= 0)
+		return true;
+#ifdef _WIN32
+	return true;
+#else
+#ifdef __APPLE__
+	char pages[16];
+#else
+	unsigned char pages[16];
+#endif
+	long long start = offset / pageSize * pageSize;
+	const long long end = offset + bytes < size ? offset + bytes : size;
+	while (start < end)
+	{
+		const long long chunk = end - start < 16 * pageSize ? end - start : 16 * pageSize;
+		if (mincore((void*)(data + start), (size_t)chunk, pages) != 0)
+			return false;
+		const int count = (int)((chunk + pageSize - 1) / pageSize);
+		for (int i = 0; i < count; ++i)
+		{
+			if (!(pages[i] & 1))
+				return false;
+		}
+		start += chunk;
+	}
+	return true;
+#endif
+}
 
 int OpenFile (char* fileName[]) {
-	FILE* newFile;
-	fopen_s(&newFile, *fileName, "r");
-	if (newFile != NULL) {
+	MappedFile file;
+	if (file.Open(*fileName)) {
 
 		return 0;
 	}
@@ -24,4 +245,4 @@ int OpenFile (char* fileName[]) {
 
 int FileExtensionVal () {
 	return 0;
-}
\ No newline at end of file
+}
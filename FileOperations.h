@@ -0,0 +1,61 @@
+#ifndef FILE_OPERATIONS_H
+#define FILE_OPERATIONS_H
+
+///
+/// File operations: opening files for transfer and streaming their contents into the send path.
+/// 
+/// 
+
+// read ahead this far past the send position, and let go of pages a quarter of it at a time
+
+const long long ReadAheadSize = 8 * 1024 * 1024;
+
+// read-only mapping of a whole file, streamed from start to end
+//  + payloads are sliced straight out of the mapped pages, the file is never copied into heap buffers
+//  + ReadAhead asks the kernel to page in the window past the send position in the background, and Release lets go
+//    of the pages behind the oldest unacked payload, so a file larger than memory streams through a bounded window
+//  + IsResident tells whether a range can be read without faulting to disk, so the network loop can wait for read-ahead
+//    instead of stalling on it. Refetch asks again for pages dropped before they were read
+
+class MappedFile
+{
+public:
+
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const char fileName[]);
+	void Close();
+
+	bool IsOpen() const;
+	long long GetSize() const;
+	const unsigned char* GetData() const;
+
+	void ReadAhead(long long offset);
+	void Refetch(long long offset);
+	void Release(long long keep);
+	bool IsResident(long long offset, int size) const;
+
+private:
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const unsigned char* data;			// the mapping, NULL for an empty file
+	long long size;
+	long long readAheadEnd;				// end of the range read-ahead has been requested for
+	long long releasedEnd;				// end of the range already released behind the oldest unacked payload
+	long long pageSize;
+	bool open;
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int file;
+#endif
+};
+
+int OpenFile(char* fileName[]);
+int FileExtensionVal();
+
+#endif
@@ -15,7 +15,26 @@
 #define PLATFORM_WINDOWS  1
 #define PLATFORM_MAC      2
 #define PLATFORM_UNIX     3
-const int PacketSizeHack = 256 + 128;
+
+// maximum datagram size in bytes (protocol id + reliability header + payload)
+//  + defaults to the largest udp payload that fits a 1500 byte ethernet mtu, define NET_MAX_DATAGRAM_SIZE to override
+
+#ifndef NET_MAX_DATAGRAM_SIZE
+#define NET_MAX_DATAGRAM_SIZE 1472
+#endif
+
+const int MaxDatagramSize = NET_MAX_DATAGRAM_SIZE;
+
+// number of ack bits carried in each reliability header (32, 64, 128 or 256)
+//  + each packet acks its ack sequence plus this many sequences before it, the header grows by 4 bytes per 32 bits
+
+#ifndef NET_ACK_BITS
+#define NET_ACK_BITS 32
+#endif
+
+// datagrams per sendmmsg / recvmmsg call in the batched socket functions
+
+const int MaxBatchSize = 64;
 
 #if defined(_WIN32)
 #define PLATFORM PLATFORM_WINDOWS
@@ -35,6 +54,25 @@ const int PacketSizeHack = 256 + 128;
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/select.h>
+
+#if defined(__linux__)
+#include <linux/net_tstamp.h>
+#include <linux/filter.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+// define NET_IO_URING to build the io_uring socket backend (linux 6.0+), switched on per socket with Socket::EnableRing
+#if defined(NET_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
 #else
 
@@ -43,12 +81,22 @@ const int PacketSizeHack = 256 + 128;
 #endif
 
 #include <assert.h>
+#include <math.h>
+#include <limits.h>
 #include <vector>
 #include <map>
 #include <stack>
 #include <list>
+#include <deque>
 #include <algorithm>
 #include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+#if defined(__AVX2__) || defined(__SSSE3__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 namespace net
 {
@@ -66,6 +114,31 @@ namespace net
 #include <unistd.h>
 	void wait(float seconds) { usleep((int)(seconds * 1000000.0f)); }
 
+#endif
+
+	// platform independent monotonic time in seconds
+
+#if PLATFORM == PLATFORM_WINDOWS
+
+	inline double get_time()
+	{
+		static LARGE_INTEGER frequency = { 0 };
+		if (frequency.QuadPart == 0)
+			QueryPerformanceFrequency(&frequency);
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return (double)counter.QuadPart / (double)frequency.QuadPart;
+	}
+
+#else
+
+	inline double get_time()
+	{
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now.tv_sec + now.tv_nsec / 1000000000.0;
+	}
+
 #endif
 	
 	// internet address
@@ -150,944 +223,7302 @@ namespace net
 		unsigned short port;
 	};
 
-	// sockets
+	// datagram descriptor for batched socket io
+	//  + address is the destination when sending and the sender when receiving
 
-	inline bool InitializeSockets()
+	struct Datagram
 	{
-#if PLATFORM == PLATFORM_WINDOWS
-		WSADATA WsaData;
-		return WSAStartup(MAKEWORD(2, 2), &WsaData) == NO_ERROR;
-#else
-		return true;
-#endif
-	}
+		Address address;				// peer address
+		unsigned char* data;			// payload buffer
+		int size;						// payload size in bytes
+	};
 
-	inline void ShutdownSockets()
+	// one piece of a datagram for scatter-gather socket io, e.g. protocol id, reliability header and payload
+	//  + sends write the segments back to back, receives fill them in order
+
+	const int MaxSegments = 4;
+
+	// limits for udp segmentation offload: datagrams per gso send and bytes per gso send or gro receive
+
+	const int MaxOffloadDatagrams = 64;
+	const int MaxOffloadBytes = 65507;
+
+	struct Segment
 	{
-#if PLATFORM == PLATFORM_WINDOWS
-		WSACleanup();
-#endif
-	}
+		unsigned char* data;
+		int size;
+	};
 
-	class Socket
+	// pooled packet buffers with reference counted handles, so a payload can be held past one call without copying it
+	//  + each thread allocates from its own pool, carved into slabs of buffers on first use by that thread (so the memory
+	//    is local to the node it runs on) and kept until the pool dies, so steady state traffic does no heap allocation
+	//  + a buffer released on another thread goes onto its pool's lock-free remote free list, which the owning thread
+	//    takes back in one exchange when its local free list runs dry
+	//  + a pool outlives its thread until the last of its buffers is released
+
+	const int PacketSlabSize = 64;
+
+	class PacketPool;
+
+	struct PacketBuffer
+	{
+		std::atomic<int> references;			// handles sharing this buffer
+		PacketPool* pool;						// pool the buffer returns to
+		PacketBuffer* next;						// free list link
+		int size;								// bytes of data in use
+		unsigned char data[MaxDatagramSize];
+	};
+
+	class PacketPool
 	{
 	public:
 
-		Socket()
+		// pool of the calling thread, created on first use
+
+		static PacketPool& GetThreadPool()
 		{
-			socket = 0;
+			static thread_local ThreadOwner owner;
+			return *owner.pool;
 		}
 
-		~Socket()
+		PacketBuffer* Allocate()
 		{
-			Close();
+			if (!local)
+				local = remote.exchange(NULL, std::memory_order_acquire);
+			if (!local)
+				Grow();
+			PacketBuffer* buffer = local;
+			local = buffer->next;
+			buffer->next = NULL;
+			buffer->size = 0;
+			buffer->references.store(1, std::memory_order_relaxed);
+			users.fetch_add(1, std::memory_order_relaxed);
+			return buffer;
 		}
 
-		bool Open(unsigned short port)
+		static void AddReference(PacketBuffer* buffer)
 		{
-			assert(!IsOpen());
+			buffer->references.fetch_add(1, std::memory_order_relaxed);
+		}
 
-			// create socket
+		static void Release(PacketBuffer* buffer)
+		{
+			if (buffer->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				buffer->pool->Free(buffer);
+		}
 
-			socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		// buffers carved so far, for checking that traffic has reached a steady state
 
-			if (socket <= 0)
-			{
-				printf("failed to create socket\n");
-				socket = 0;
-				return false;
-			}
+		int GetCapacity() const
+		{
+			return (int)slabs.size() * PacketSlabSize;
+		}
 
-			// bind to port
+	private:
 
-			sockaddr_in address;
-			address.sin_family = AF_INET;
-			address.sin_addr.s_addr = INADDR_ANY;
-			address.sin_port = htons((unsigned short)port);
+		// creates the thread's pool and lets it go when the thread exits
 
-			if (bind(socket, (const sockaddr*)&address, sizeof(sockaddr_in)) < 0)
+		struct ThreadOwner
+		{
+			ThreadOwner()
 			{
-				printf("failed to bind socket\n");
-				Close();
-				return false;
+				pool = new PacketPool();
+				Current() = pool;
 			}
 
-			// set non-blocking io
+			~ThreadOwner()
+			{
+				Current() = NULL;
+				pool->Unuse();
+			}
 
-#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+			PacketPool* pool;
+		};
 
-			int nonBlocking = 1;
-			if (fcntl(socket, F_SETFL, O_NONBLOCK, nonBlocking) == -1)
+		static PacketPool*& Current()
+		{
+			static thread_local PacketPool* current = NULL;
+			return current;
+		}
+
+		PacketPool() : remote(NULL), users(1)
+		{
+			local = NULL;
+		}
+
+		~PacketPool()
+		{
+			for (size_t i = 0; i < slabs.size(); ++i)
+				delete[] slabs[i];
+		}
+
+		void Grow()
+		{
+			PacketBuffer* slab = new PacketBuffer[PacketSlabSize];
+			slabs.push_back(slab);
+			for (int i = 0; i < PacketSlabSize; ++i)
 			{
-				printf("failed to set non-blocking socket\n");
-				Close();
-				return false;
+				slab[i].pool = this;
+				slab[i].next = local;
+				local = &slab[i];
 			}
+		}
 
-#elif PLATFORM == PLATFORM_WINDOWS
-
-			DWORD nonBlocking = 1;
-			if (ioctlsocket(socket, FIONBIO, &nonBlocking) != 0)
+		void Free(PacketBuffer* buffer)
+		{
+			if (Current() == this)
 			{
-				printf("failed to set non-blocking socket\n");
-				Close();
-				return false;
+				buffer->next = local;
+				local = buffer;
 			}
+			else
+			{
+				PacketBuffer* head = remote.load(std::memory_order_relaxed);
+				do
+					buffer->next = head;
+				while (!remote.compare_exchange_weak(head, buffer, std::memory_order_release, std::memory_order_relaxed));
+			}
+			Unuse();
+		}
 
-#endif
+		// users counts outstanding buffers plus one for the owning thread, whoever drops it to zero deletes the pool
 
-			return true;
+		void Unuse()
+		{
+			if (users.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				delete this;
 		}
 
-		void Close()
+		PacketBuffer* local;						// free buffers, only touched by the owning thread
+		std::atomic<PacketBuffer*> remote;			// buffers freed by other threads
+		std::atomic<int> users;						// outstanding buffers + 1 while the owning thread lives
+		std::vector<PacketBuffer*> slabs;			// PacketSlabSize buffers each
+	};
+
+	// reference counted handle to a pooled packet buffer, copies share the buffer and the last one returns it
+	//  + the bytes of a shared buffer should be treated as read only
+
+	class PacketHandle
+	{
+	public:
+
+		PacketHandle()
 		{
-			if (socket != 0)
-			{
-#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
-				close(socket);
-#elif PLATFORM == PLATFORM_WINDOWS
-				closesocket(socket);
-#endif
-				socket = 0;
-			}
+			buffer = NULL;
 		}
 
-		bool IsOpen() const
+		PacketHandle(const PacketHandle& other)
 		{
-			return socket != 0;
+			buffer = other.buffer;
+			if (buffer)
+				PacketPool::AddReference(buffer);
 		}
 
-		bool Send(const Address& destination, const void* data, int size)
+		PacketHandle(PacketHandle&& other)
 		{
-			assert(data);
-			assert(PacketSizeHack > 0);
+			buffer = other.buffer;
+			other.buffer = NULL;
+		}
 
-			if (socket == 0)
-				return false;
+		~PacketHandle()
+		{
+			Reset();
+		}
 
-			assert(destination.GetAddress() != 0);
-			assert(destination.GetPort() != 0);
+		PacketHandle& operator = (const PacketHandle& other)
+		{
+			if (other.buffer)
+				PacketPool::AddReference(other.buffer);
+			Reset();
+			buffer = other.buffer;
+			return *this;
+		}
 
-			sockaddr_in address;
-			address.sin_family = AF_INET;
-			address.sin_addr.s_addr = htonl(destination.GetAddress());
-			address.sin_port = htons((unsigned short)destination.GetPort());
+		PacketHandle& operator = (PacketHandle&& other)
+		{
+			if (this != &other)
+			{
+				Reset();
+				buffer = other.buffer;
+				other.buffer = NULL;
+			}
+			return *this;
+		}
 
-			int sent_bytes = sendto(socket, (const char*)data, PacketSizeHack, 0, (sockaddr*)&address, sizeof(sockaddr_in));
+		// new empty buffer from the calling thread's pool
 
-			return sent_bytes == PacketSizeHack;
+		static PacketHandle Allocate()
+		{
+			PacketHandle handle;
+			handle.buffer = PacketPool::GetThreadPool().Allocate();
+			return handle;
 		}
 
-		int Receive(Address& sender, void* data, int size)
+		static PacketHandle Allocate(const unsigned char data[], int size)
 		{
-			assert(data);
-			assert(PacketSizeHack > 0);
+			assert(size >= 0 && size <= MaxDatagramSize);
+			PacketHandle handle = Allocate();
+			memcpy(handle.buffer->data, data, size);
+			handle.buffer->size = size;
+			return handle;
+		}
 
-			if (socket == 0)
-				return false;
+		void Reset()
+		{
+			if (buffer)
+				PacketPool::Release(buffer);
+			buffer = NULL;
+		}
 
-#if PLATFORM == PLATFORM_WINDOWS
-			typedef int socklen_t;
-#endif
+		// make sure this handle holds a buffer nobody else shares, e.g. before receiving into it
 
-			sockaddr_in from;
-			socklen_t fromLength = sizeof(from);
+		void MakeUnique()
+		{
+			if (!buffer || IsShared())
+				*this = Allocate();
+		}
+
+		bool IsValid() const
+		{
+			return buffer != NULL;
+		}
 
-			int received_bytes = recvfrom(socket, (char*)data, PacketSizeHack, 0, (sockaddr*)&from, &fromLength);
+		bool IsShared() const
+		{
+			return buffer && buffer->references.load(std::memory_order_relaxed) > 1;
+		}
 
-			if (received_bytes <= 0)
-				return 0;
+		unsigned char* GetData() const
+		{
+			assert(buffer);
+			return buffer->data;
+		}
 
-			unsigned int address = ntohl(from.sin_addr.s_addr);
-			unsigned short port = ntohs(from.sin_port);
+		int GetSize() const
+		{
+			return buffer ? buffer->size : 0;
+		}
 
-			sender = Address(address, port);
+		void SetSize(int size)
+		{
+			assert(buffer);
+			assert(size >= 0 && size <= MaxDatagramSize);
+			buffer->size = size;
+		}
 
-			return received_bytes;
+		int GetCapacity() const
+		{
+			return MaxDatagramSize;
 		}
 
 	private:
 
-		int socket;
+		PacketBuffer* buffer;
 	};
 
-	// connection
+#if defined(NET_IO_URING) && defined(__linux__)
 
-	class Connection
+	// io_uring socket backend, used by a Socket once EnableRing succeeds
+	//  + receives come from one multishot recvmsg filling a kernel-registered ring of provided buffers, so an empty
+	//    socket costs no syscall and a busy one delivers many datagrams per kernel entry
+	//  + sends are copied into slots and queued as sendmsg entries that Flush submits together, once per tick
+	//  + completions are reaped from the shared completion ring without syscalls. the ring fd is what to wait on
+
+	class UringBackend
 	{
 	public:
 
-		enum Mode
+		enum
 		{
-			None,
-			Client,
-			Server
+			QueueDepth = 256,				// submission entries, also the number of send slots
+			CompletionDepth = 1024,			// completion entries
+			ReceiveBuffers = 512,			// provided receive buffers (power of two)
+			ReceiveBufferSize = 2048,		// recvmsg header, sender address and one datagram
+			ReceiveGroup = 0				// provided buffer group id
 		};
 
-		Connection(unsigned int protocolId, float timeout)
+		UringBackend()
 		{
-			this->protocolId = protocolId;
-			this->timeout = timeout;
-			mode = None;
-			running = false;
-			ClearData();
+			ring = -1;
+			socket = -1;
+			sqRingMemory = cqRingMemory = sqeMemory = MAP_FAILED;
+			bufferRing = (io_uring_buf*)MAP_FAILED;
+			sqRingSize = cqRingSize = sqeSize = bufferRingSize = 0;
+			pending = 0;
+			bufferTail = 0;
+			completedHead = completedCount = 0;
+			sendErrors = 0;
 		}
 
-		virtual ~Connection()
+		~UringBackend()
 		{
-			if (IsRunning())
-				Stop();
+			Close();
 		}
 
-		bool Start(int port)
+		bool Open(int socket)
 		{
-			assert(!running);
-			printf("start connection on port %d\n", port);
-			if (!socket.Open(port))
+			assert(ring < 0);
+
+			io_uring_params params;
+			memset(&params, 0, sizeof(params));
+			params.flags = IORING_SETUP_CLAMP | IORING_SETUP_CQSIZE;
+			params.cq_entries = CompletionDepth;
+			ring = (int)syscall(__NR_io_uring_setup, QueueDepth, &params);
+			if (ring < 0)
+			{
+				ring = -1;
 				return false;
-			running = true;
-			OnStart();
+			}
+
+			// map the submission and completion rings and the submission entries
+
+			sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+			cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+			if (single)
+				sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+			sqRingMemory = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+			if (sqRingMemory == MAP_FAILED)
+				return Fail();
+			cqRingMemory = single ? sqRingMemory : mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+			if (cqRingMemory == MAP_FAILED)
+				return Fail();
+			sqeSize = params.sq_entries * sizeof(io_uring_sqe);
+			sqeMemory = mmap(NULL, sqeSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+			if (sqeMemory == MAP_FAILED)
+				return Fail();
+
+			unsigned char* sq = (unsigned char*)sqRingMemory;
+			sqHead = (unsigned int*)(sq + params.sq_off.head);
+			sqTail = (unsigned int*)(sq + params.sq_off.tail);
+			sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+			sqEntries = (unsigned int*)(sq + params.sq_off.ring_entries);
+			sqFlags = (unsigned int*)(sq + params.sq_off.flags);
+			sqArray = (unsigned int*)(sq + params.sq_off.array);
+			sqes = (io_uring_sqe*)sqeMemory;
+			unsigned char* cq = (unsigned char*)cqRingMemory;
+			cqHead = (unsigned int*)(cq + params.cq_off.head);
+			cqTail = (unsigned int*)(cq + params.cq_off.tail);
+			cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+			cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+			// register the provided buffer ring and hand it every receive buffer
+
+			bufferRingSize = ReceiveBuffers * sizeof(io_uring_buf);
+			bufferRing = (io_uring_buf*)mmap(NULL, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (bufferRing == MAP_FAILED)
+				return Fail();
+			io_uring_buf_reg registration;
+			memset(&registration, 0, sizeof(registration));
+			registration.ring_addr = (unsigned long long)bufferRing;
+			registration.ring_entries = ReceiveBuffers;
+			registration.bgid = ReceiveGroup;
+			if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+				return Fail();
+			receiveMemory.resize(ReceiveBuffers * ReceiveBufferSize);
+			bufferTail = 0;
+			for (int i = 0; i < ReceiveBuffers; ++i)
+				RecycleBuffer(i);
+
+			completed.resize(CompletionDepth);
+			slots.resize(QueueDepth);
+			freeSlots.clear();
+			for (int i = QueueDepth - 1; i >= 0; --i)
+				freeSlots.push_back(i);
+
+			this->socket = socket;
+			memset(&receiveMessage, 0, sizeof(receiveMessage));
+			receiveMessage.msg_namelen = sizeof(sockaddr_in);
+			if (!ArmReceive())
+				return Fail();
+			Flush();
 			return true;
 		}
 
-		void Stop()
-		{
-			assert(running);
-			printf("stop connection\n");
-			bool connected = IsConnected();
-			ClearData();
-			socket.Close();
-			running = false;
-			if (connected)
-				OnDisconnect();
-			OnStop();
-		}
+		// closing the ring cancels the outstanding receive, the socket itself belongs to the caller
 
-		bool IsRunning() const
+		void Close()
 		{
-			return running;
+			if (ring >= 0)
+				close(ring);
+			ring = -1;
+			if (sqeMemory != MAP_FAILED)
+				munmap(sqeMemory, sqeSize);
+			if (cqRingMemory != MAP_FAILED && cqRingMemory != sqRingMemory)
+				munmap(cqRingMemory, cqRingSize);
+			if (sqRingMemory != MAP_FAILED)
+				munmap(sqRingMemory, sqRingSize);
+			if (bufferRing != MAP_FAILED)
+				munmap(bufferRing, bufferRingSize);
+			sqRingMemory = cqRingMemory = sqeMemory = MAP_FAILED;
+			bufferRing = (io_uring_buf*)MAP_FAILED;
+			receiveMemory.clear();
+			completed.clear();
+			completedHead = completedCount = 0;
+			slots.clear();
+			freeSlots.clear();
+			pending = 0;
+			socket = -1;
 		}
 
-		void Listen()
+		int GetHandle() const
 		{
-			printf("server listening for connection\n");
-			bool connected = IsConnected();
-			ClearData();
-			if (connected)
-				OnDisconnect();
-			mode = Server;
-			state = Listening;
+			return ring;
 		}
 
-		void Connect(const Address& address)
+		unsigned int GetSendErrors() const
 		{
-			printf("client connecting to %d.%d.%d.%d:%d\n",
-				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
-			bool connected = IsConnected();
-			ClearData();
-			if (connected)
-				OnDisconnect();
-			mode = Client;
-			state = Connecting;
-			this->address = address;
+			return sendErrors;
 		}
 
-		bool IsConnecting() const
-		{
-			return state == Connecting;
-		}
+		// queue a datagram gathered from the segments, it goes out on the next Flush. false if every send slot is busy
 
-		bool ConnectFailed() const
+		bool Send(const sockaddr_in& address, const Segment segments[], int count)
 		{
-			return state == ConnectFail;
-		}
+			if (freeSlots.empty())
+			{
+				Flush();
+				Reap();
+				if (freeSlots.empty())
+					return false;
+			}
+			int size = 0;
+			for (int i = 0; i < count; ++i)
+				size += segments[i].size;
+			if (size > MaxDatagramSize)
+				return false;
+			io_uring_sqe* sqe = GetSubmission();
+			if (!sqe)
+				return false;
+
+			const int index = freeSlots.back();
+			freeSlots.pop_back();
+			SendSlot& slot = slots[index];
+			int offset = 0;
+			for (int i = 0; i < count; ++i)
+			{
+				memcpy(slot.data + offset, segments[i].data, segments[i].size);
+				offset += segments[i].size;
+			}
+			slot.address = address;
+			slot.vector.iov_base = slot.data;
+			slot.vector.iov_len = size;
+			memset(&slot.message, 0, sizeof(slot.message));
+			slot.message.msg_name = &slot.address;
+			slot.message.msg_namelen = sizeof(sockaddr_in);
+			slot.message.msg_iov = &slot.vector;
+			slot.message.msg_iovlen = 1;
+
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = socket;
+			sqe->addr = (unsigned long long)&slot.message;
+			sqe->len = 1;
+			sqe->user_data = index;
+			return true;
+		}
+
+		// next received datagram scattered into the segments, returns its size or 0 once nothing more has arrived
+		//  + datagrams that do not fit in the segments are skipped
+
+		int Receive(sockaddr_in& from, const Segment segments[], int count)
+		{
+			while (true)
+			{
+				if (completedCount == 0)
+				{
+					Flush();
+					Reap();
+					if (completedCount == 0)
+						return 0;
+				}
+				const io_uring_cqe completion = completed[completedHead];
+				completedHead = (completedHead + 1) & (CompletionDepth - 1);
+				completedCount--;
+
+				// the kernel ends a multishot receive when it runs out of buffers or the completion ring overflows
+
+				if (!(completion.flags & IORING_CQE_F_MORE))
+				{
+					ArmReceive();
+					if (completion.res < 0)
+						return 0;
+				}
+				if (completion.res < 0 || !(completion.flags & IORING_CQE_F_BUFFER))
+					continue;
+
+				const int buffer = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+				const unsigned char* data = &receiveMemory[buffer * ReceiveBufferSize];
+				io_uring_recvmsg_out header;
+				memcpy(&header, data, sizeof(header));
+				const unsigned char* name = data + sizeof(header);
+				const unsigned char* payload = name + receiveMessage.msg_namelen + receiveMessage.msg_controllen;
+				const int bytes = (int)header.payloadlen;
+
+				int offset = 0;
+				const bool valid = bytes > 0 && !(header.flags & MSG_TRUNC) && header.namelen >= sizeof(sockaddr_in);
+				if (valid)
+				{
+					memcpy(&from, name, sizeof(sockaddr_in));
+					for (int i = 0; i < count && offset < bytes; ++i)
+					{
+						const int n = std::min(segments[i].size, bytes - offset);
+						memcpy(segments[i].data, payload + offset, n);
+						offset += n;
+					}
+				}
+				RecycleBuffer(buffer);
+				if (valid && offset == bytes)
+					return bytes;
+			}
+		}
+
+		// submit queued sends (and a re-armed receive) in one syscall
+
+		void Flush()
+		{
+			const bool overflow = (__atomic_load_n(sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) != 0;
+			if (pending == 0 && !overflow)
+				return;
+			const int submitted = (int)syscall(__NR_io_uring_enter, ring, pending, 0, overflow ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+			if (submitted > 0)
+				pending -= std::min((unsigned int)submitted, pending);
+		}
+
+	private:
+
+		struct SendSlot
+		{
+			msghdr message;
+			iovec vector;
+			sockaddr_in address;
+			unsigned char data[MaxDatagramSize];
+		};
+
+		enum { ReceiveTag = 0xFFFFFFFF };	// user data of the multishot receive, sends carry their slot index
+
+		bool Fail()
+		{
+			Close();
+			return false;
+		}
+
+		io_uring_sqe* GetSubmission()
+		{
+			if (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= *sqEntries)
+			{
+				Flush();
+				if (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= *sqEntries)
+					return NULL;
+			}
+			const unsigned int tail = *sqTail;
+			const unsigned int index = tail & *sqMask;
+			io_uring_sqe* sqe = &sqes[index];
+			memset(sqe, 0, sizeof(io_uring_sqe));
+			sqArray[index] = index;
+			__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+			pending++;
+			return sqe;
+		}
+
+		bool ArmReceive()
+		{
+			io_uring_sqe* sqe = GetSubmission();
+			if (!sqe)
+				return false;
+			sqe->opcode = IORING_OP_RECVMSG;
+			sqe->fd = socket;
+			sqe->addr = (unsigned long long)&receiveMessage;
+			sqe->len = 1;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = ReceiveGroup;
+			sqe->user_data = ReceiveTag;
+			return true;
+		}
+
+		// move completions off the shared ring: sends free their slot, receives wait in completed for Receive
+		//  + stops early once completed is full, the rest stay on the shared ring until Receive catches up
+
+		void Reap()
+		{
+			unsigned int head = *cqHead;
+			const unsigned int tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+			while (head != tail)
+			{
+				const io_uring_cqe& completion = cqes[head & *cqMask];
+				if (completion.user_data == ReceiveTag)
+				{
+					if (completedCount == CompletionDepth)
+						break;
+					completed[(completedHead + completedCount) & (CompletionDepth - 1)] = completion;
+					completedCount++;
+				}
+				else
+				{
+					if (completion.res < 0)
+						sendErrors++;
+					freeSlots.push_back((int)completion.user_data);
+				}
+				head++;
+			}
+			__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+		}
+
+		// the ring tail overlays the resv field of the first entry (io_uring_buf_ring's flexible array member does not
+		// lay out the same way in c++, so the entries are addressed directly)
+
+		void RecycleBuffer(int buffer)
+		{
+			io_uring_buf& entry = bufferRing[bufferTail & (ReceiveBuffers - 1)];
+			entry.addr = (unsigned long long)&receiveMemory[buffer * ReceiveBufferSize];
+			entry.len = ReceiveBufferSize;
+			entry.bid = (unsigned short)buffer;
+			bufferTail++;
+			__atomic_store_n(&bufferRing[0].resv, bufferTail, __ATOMIC_RELEASE);
+		}
+
+		int ring;									// io_uring fd
+		int socket;									// socket the ring sends and receives on
+		void* sqRingMemory;							// mapped submission ring
+		void* cqRingMemory;							// mapped completion ring (same mapping as sqRingMemory on single mmap kernels)
+		void* sqeMemory;							// mapped submission entries
+		size_t sqRingSize, cqRingSize, sqeSize;
+		unsigned int *sqHead, *sqTail, *sqMask, *sqEntries, *sqFlags, *sqArray;
+		io_uring_sqe* sqes;
+		unsigned int *cqHead, *cqTail, *cqMask;
+		io_uring_cqe* cqes;
+		unsigned int pending;						// submission entries queued since the last io_uring_enter
+		io_uring_buf* bufferRing;					// provided buffer ring registered with the kernel
+		size_t bufferRingSize;
+		unsigned short bufferTail;					// next free entry of bufferRing
+		std::vector<unsigned char> receiveMemory;	// ReceiveBuffers buffers of ReceiveBufferSize bytes
+		msghdr receiveMessage;						// template for the multishot recvmsg (sender address, no control data)
+		std::vector<io_uring_cqe> completed;		// ring of reaped receive completions not yet handed out
+		int completedHead, completedCount;
+		std::vector<SendSlot> slots;				// datagrams owned by in flight sends
+		std::vector<int> freeSlots;
+		unsigned int sendErrors;					// sends that completed with an error
+	};
+
+#endif
+
+	// sockets
+
+	inline bool InitializeSockets()
+	{
+#if PLATFORM == PLATFORM_WINDOWS
+		WSADATA WsaData;
+		return WSAStartup(MAKEWORD(2, 2), &WsaData) == NO_ERROR;
+#else
+		return true;
+#endif
+	}
+
+	inline void ShutdownSockets()
+	{
+#if PLATFORM == PLATFORM_WINDOWS
+		WSACleanup();
+#endif
+	}
+
+	class Socket
+	{
+	public:
+
+		Socket()
+		{
+			socket = 0;
+			txtime = false;
+			offload = false;
+			offloadOffset = 0;
+			offloadSize = 0;
+			offloadSegment = 0;
+			ring = NULL;
+		}
+
+		~Socket()
+		{
+			Close();
+		}
+
+		// with reusePort several sockets may bind the same port and the kernel spreads incoming datagrams between them
+
+		bool Open(unsigned short port, bool reusePort = false)
+		{
+			assert(!IsOpen());
+
+			// create socket
+
+			socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+			if (socket <= 0)
+			{
+				printf("failed to create socket\n");
+				socket = 0;
+				return false;
+			}
+
+			if (reusePort)
+			{
+#if defined(SO_REUSEPORT)
+				int enable = 1;
+				if (setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, (const char*)&enable, sizeof(enable)) < 0)
+				{
+					printf("failed to set SO_REUSEPORT\n");
+					Close();
+					return false;
+				}
+#else
+				printf("SO_REUSEPORT is not supported on this platform\n");
+				Close();
+				return false;
+#endif
+			}
+
+			// bind to port
+
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = INADDR_ANY;
+			address.sin_port = htons((unsigned short)port);
+
+			if (bind(socket, (const sockaddr*)&address, sizeof(sockaddr_in)) < 0)
+			{
+				printf("failed to bind socket\n");
+				Close();
+				return false;
+			}
+
+			// set non-blocking io
+
+#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+
+			int nonBlocking = 1;
+			if (fcntl(socket, F_SETFL, O_NONBLOCK, nonBlocking) == -1)
+			{
+				printf("failed to set non-blocking socket\n");
+				Close();
+				return false;
+			}
+
+#elif PLATFORM == PLATFORM_WINDOWS
+
+			DWORD nonBlocking = 1;
+			if (ioctlsocket(socket, FIONBIO, &nonBlocking) != 0)
+			{
+				printf("failed to set non-blocking socket\n");
+				Close();
+				return false;
+			}
+
+#endif
+
+			return true;
+		}
+
+		void Close()
+		{
+			DisableRing();
+			if (socket != 0)
+			{
+#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+				close(socket);
+#elif PLATFORM == PLATFORM_WINDOWS
+				closesocket(socket);
+#endif
+				socket = 0;
+				txtime = false;
+				offload = false;
+				offloadOffset = 0;
+				offloadSize = 0;
+			}
+		}
+
+		bool IsOpen() const
+		{
+			return socket != 0;
+		}
+
+		int GetHandle() const
+		{
+			return socket;
+		}
+
+		// handle a reactor should wait on: the io_uring fd once the ring backend is enabled, otherwise the socket
+
+		int GetWaitHandle() const
+		{
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring)
+				return ring->GetHandle();
+#endif
+			return socket;
+		}
+
+		// switch this socket to the io_uring backend (needs NET_IO_URING and linux 6.0+), returns false if unavailable
+		//  + sends are queued until Flush, which connections call once per Update
+
+		bool EnableRing()
+		{
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (socket == 0 || offload)
+				return false;
+			if (ring)
+				return true;
+			ring = new UringBackend();
+			if (!ring->Open(socket))
+			{
+				DisableRing();
+				return false;
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		bool IsRingEnabled() const
+		{
+			return ring != NULL;
+		}
+
+		// submit queued sends, a no-op unless the ring backend is enabled
+
+		void Flush()
+		{
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring)
+				ring->Flush();
+#endif
+		}
+
+		// kernel pacing: with SO_TXTIME enabled, SendAt hands each datagram to the kernel with a CLOCK_MONOTONIC
+		// departure time and the fq qdisc releases it then. returns false where the platform or kernel lacks support
+
+		bool EnableTxTime()
+		{
+#if defined(__linux__) && defined(SO_TXTIME)
+			if (socket == 0)
+				return false;
+			sock_txtime config;
+			config.clockid = CLOCK_MONOTONIC;
+			config.flags = 0;
+			if (setsockopt(socket, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) != 0)
+				return false;
+			txtime = true;
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		// udp segmentation offload for bulk transfer (linux 5.0+): SendBatch hands runs of equal size datagrams to the same
+		// destination to the kernel as one UDP_SEGMENT send of up to 64 KB, and with UDP_GRO the kernel coalesces arriving
+		// datagrams into one buffer that every receive function splits back up by the reported segment size.
+		// returns false where the platform or kernel lacks support
+
+		bool EnableOffload()
+		{
+#if defined(__linux__) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+			if (socket == 0 || ring)
+				return false;
+			int segment = 0;
+			if (setsockopt(socket, IPPROTO_UDP, UDP_SEGMENT, &segment, sizeof(segment)) != 0)
+				return false;
+			int enable = 1;
+			if (setsockopt(socket, IPPROTO_UDP, UDP_GRO, &enable, sizeof(enable)) != 0)
+				return false;
+			offloadBuffer.resize(MaxOffloadBytes);
+			offload = true;
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		bool SendAt(const Address& destination, const void* data, int size, double time)
+		{
+#if defined(__linux__) && defined(SO_TXTIME)
+			assert(data);
+			assert(size > 0);
+
+			if (socket == 0)
+				return false;
+			if (!txtime || ring)
+				return Send(destination, data, size);
+
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(destination.GetAddress());
+			address.sin_port = htons((unsigned short)destination.GetPort());
+
+			iovec vector;
+			vector.iov_base = (void*)data;
+			vector.iov_len = size;
+
+			unsigned long long departure = (unsigned long long)(time * 1000000000.0);
+			char control[CMSG_SPACE(sizeof(departure))];
+			memset(control, 0, sizeof(control));
+
+			msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_name = &address;
+			message.msg_namelen = sizeof(sockaddr_in);
+			message.msg_iov = &vector;
+			message.msg_iovlen = 1;
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+
+			cmsghdr* header = CMSG_FIRSTHDR(&message);
+			header->cmsg_level = SOL_SOCKET;
+			header->cmsg_type = SCM_TXTIME;
+			header->cmsg_len = CMSG_LEN(sizeof(departure));
+			memcpy(CMSG_DATA(header), &departure, sizeof(departure));
+
+			return sendmsg(socket, &message, 0) == size;
+#else
+			return Send(destination, data, size);
+#endif
+		}
+
+		bool Send(const Address& destination, const void* data, int size)
+		{
+			assert(data);
+			assert(size > 0);
+
+			if (socket == 0)
+				return false;
+
+			assert(destination.GetAddress() != 0);
+			assert(destination.GetPort() != 0);
+
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(destination.GetAddress());
+			address.sin_port = htons((unsigned short)destination.GetPort());
+
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring)
+			{
+				Segment segment;
+				segment.data = (unsigned char*)data;
+				segment.size = size;
+				return ring->Send(address, &segment, 1);
+			}
+#endif
+
+			int sent_bytes = sendto(socket, (const char*)data, size, 0, (sockaddr*)&address, sizeof(sockaddr_in));
+
+			return sent_bytes == size;
+		}
+
+		// gather send: the segments go out as one datagram, so headers are prepended without copying the payload behind them
+
+		bool Send(const Address& destination, const Segment segments[], int count)
+		{
+			assert(segments);
+			assert(count > 0 && count <= MaxSegments);
+
+			if (socket == 0)
+				return false;
+
+			assert(destination.GetAddress() != 0);
+			assert(destination.GetPort() != 0);
+
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(destination.GetAddress());
+			address.sin_port = htons((unsigned short)destination.GetPort());
+
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring)
+				return ring->Send(address, segments, count);
+#endif
+
+			int size = 0;
+			for (int i = 0; i < count; ++i)
+				size += segments[i].size;
+
+#if PLATFORM == PLATFORM_WINDOWS
+
+			assert(size <= MaxDatagramSize);
+			unsigned char packet[MaxDatagramSize];
+			int offset = 0;
+			for (int i = 0; i < count; ++i)
+			{
+				memcpy(packet + offset, segments[i].data, segments[i].size);
+				offset += segments[i].size;
+			}
+			int sent_bytes = sendto(socket, (const char*)packet, size, 0, (sockaddr*)&address, sizeof(sockaddr_in));
+
+#else
+
+			iovec vectors[MaxSegments];
+			for (int i = 0; i < count; ++i)
+			{
+				vectors[i].iov_base = segments[i].data;
+				vectors[i].iov_len = segments[i].size;
+			}
+			msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_name = &address;
+			message.msg_namelen = sizeof(sockaddr_in);
+			message.msg_iov = vectors;
+			message.msg_iovlen = count;
+			int sent_bytes = (int)sendmsg(socket, &message, 0);
+
+#endif
+
+			return sent_bytes == size;
+		}
+
+		int Receive(Address& sender, void* data, int size)
+		{
+			assert(data);
+			assert(size > 0);
+
+			if (socket == 0)
+				return false;
+
+			if (offload || ring)
+			{
+				Segment segment;
+				segment.data = (unsigned char*)data;
+				segment.size = size;
+				return Receive(sender, &segment, 1);
+			}
+
+#if PLATFORM == PLATFORM_WINDOWS
+			typedef int socklen_t;
+#endif
+
+			sockaddr_in from;
+			socklen_t fromLength = sizeof(from);
+
+			int received_bytes = recvfrom(socket, (char*)data, size, 0, (sockaddr*)&from, &fromLength);
+
+			if (received_bytes <= 0)
+				return 0;
+
+			unsigned int address = ntohl(from.sin_addr.s_addr);
+			unsigned short port = ntohs(from.sin_port);
+
+			sender = Address(address, port);
+
+			return received_bytes;
+		}
+
+		// pooled variants: send a buffer's bytes, or receive a datagram into a buffer nobody else shares
+
+		bool Send(const Address& destination, const PacketHandle& packet)
+		{
+			return Send(destination, packet.GetData(), packet.GetSize());
+		}
+
+		int Receive(Address& sender, PacketHandle& packet)
+		{
+			packet.MakeUnique();
+			packet.SetSize(Receive(sender, packet.GetData(), packet.GetCapacity()));
+			return packet.GetSize();
+		}
+
+		// scatter receive: the datagram fills the segments in order, so a header can land apart from the payload
+		//  + returns the datagram size, or 0 if nothing was received or the datagram did not fit in the segments
+
+		int Receive(Address& sender, const Segment segments[], int count)
+		{
+			assert(segments);
+			assert(count > 0 && count <= MaxSegments);
+
+			if (socket == 0)
+				return 0;
+
+			if (offload)
+				return ReceiveOffload(sender, segments, count);
+
+			sockaddr_in from;
+
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring)
+			{
+				const int bytes = ring->Receive(from, segments, count);
+				if (bytes > 0)
+					sender = Address(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+				return bytes;
+			}
+#endif
+
+#if PLATFORM == PLATFORM_WINDOWS
+
+			typedef int socklen_t;
+			socklen_t fromLength = sizeof(from);
+			unsigned char packet[MaxDatagramSize];
+			int received_bytes = recvfrom(socket, (char*)packet, MaxDatagramSize, 0, (sockaddr*)&from, &fromLength);
+			if (received_bytes <= 0)
+				return 0;
+			int offset = 0;
+			for (int i = 0; i < count && offset < received_bytes; ++i)
+			{
+				const int bytes = std::min(segments[i].size, received_bytes - offset);
+				memcpy(segments[i].data, packet + offset, bytes);
+				offset += bytes;
+			}
+			if (offset < received_bytes)
+				return 0;
+
+#else
+
+			iovec vectors[MaxSegments];
+			for (int i = 0; i < count; ++i)
+			{
+				vectors[i].iov_base = segments[i].data;
+				vectors[i].iov_len = segments[i].size;
+			}
+			msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_name = &from;
+			message.msg_namelen = sizeof(from);
+			message.msg_iov = vectors;
+			message.msg_iovlen = count;
+			int received_bytes = (int)recvmsg(socket, &message, 0);
+			if (received_bytes <= 0 || (message.msg_flags & MSG_TRUNC))
+				return 0;
+
+#endif
+
+			sender = Address(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+
+			return received_bytes;
+		}
+
+		// send a batch of datagrams, returns the number of datagrams handed to the socket
+		//  + on linux this is one sendmmsg call per MaxBatchSize datagrams, other platforms fall back to one Send per datagram
+
+		int SendBatch(const Datagram packets[], int count)
+		{
+			assert(packets);
+			assert(count >= 0);
+
+			if (socket == 0)
+				return 0;
+
+#if defined(__linux__)
+
+			if (offload)
+				return SendBatchOffload(packets, count);
+
+#if defined(NET_IO_URING)
+			if (ring)
+			{
+				int sent = 0;
+				while (sent < count && Send(packets[sent].address, packets[sent].data, packets[sent].size))
+					sent++;
+				ring->Flush();
+				return sent;
+			}
+#endif
+
+			int sent = 0;
+			while (sent < count)
+			{
+				const int batch = count - sent < MaxBatchSize ? count - sent : MaxBatchSize;
+
+				mmsghdr messages[MaxBatchSize];
+				iovec vectors[MaxBatchSize];
+				sockaddr_in addresses[MaxBatchSize];
+				memset(messages, 0, sizeof(mmsghdr) * batch);
+
+				for (int i = 0; i < batch; ++i)
+				{
+					const Datagram& packet = packets[sent + i];
+					assert(packet.data);
+					assert(packet.address.GetAddress() != 0);
+					assert(packet.address.GetPort() != 0);
+					addresses[i].sin_family = AF_INET;
+					addresses[i].sin_addr.s_addr = htonl(packet.address.GetAddress());
+					addresses[i].sin_port = htons((unsigned short)packet.address.GetPort());
+					vectors[i].iov_base = packet.data;
+					vectors[i].iov_len = packet.size;
+					messages[i].msg_hdr.msg_name = &addresses[i];
+					messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+					messages[i].msg_hdr.msg_iov = &vectors[i];
+					messages[i].msg_hdr.msg_iovlen = 1;
+				}
+
+				int result = sendmmsg(socket, messages, batch, 0);
+				if (result <= 0)
+					break;
+				sent += result;
+				if (result < batch)
+					break;
+			}
+			return sent;
+
+#else
+
+			int sent = 0;
+			while (sent < count && Send(packets[sent].address, packets[sent].data, packets[sent].size))
+				sent++;
+			return sent;
+
+#endif
+		}
+
+		// receive up to count datagrams into the caller's buffers (each size bytes), returns the number received
+		//  + on linux this is one recvmmsg call per MaxBatchSize datagrams, other platforms fall back to one Receive per datagram
+		//  + with headers, the first headerSize bytes of datagram i land in headers + i * headerSize and only the rest in
+		//    packets[i].data, so headers are parsed in place. size then still counts the whole datagram
+
+		int ReceiveBatch(Datagram packets[], int count, int size, unsigned char headers[] = NULL, int headerSize = 0)
+		{
+			assert(packets);
+			assert(count >= 0);
+			assert(size > 0);
+
+			if (socket == 0)
+				return 0;
+
+#if defined(__linux__)
+
+			if (!offload && !ring)
+				return ReceiveBatchMessages(packets, count, size, headers, headerSize);
+
+#endif
+
+			int received = 0;
+			while (received < count)
+			{
+				Datagram& packet = packets[received];
+				if (headers)
+				{
+					Segment segments[2];
+					segments[0].data = headers + received * headerSize;
+					segments[0].size = headerSize;
+					segments[1].data = packet.data;
+					segments[1].size = size;
+					packet.size = Receive(packet.address, segments, 2);
+				}
+				else
+					packet.size = Receive(packet.address, packet.data, size);
+				if (packet.size <= 0)
+					break;
+				received++;
+			}
+			return received;
+		}
+
+	private:
+
+		void DisableRing()
+		{
+#if defined(NET_IO_URING) && defined(__linux__)
+			delete ring;
+#endif
+			ring = NULL;
+		}
+
+#if defined(__linux__)
+
+		// recvmmsg path of ReceiveBatch
+
+		int ReceiveBatchMessages(Datagram packets[], int count, int size, unsigned char headers[], int headerSize)
+		{
+			int received = 0;
+			while (received < count)
+			{
+				const int batch = count - received < MaxBatchSize ? count - received : MaxBatchSize;
+
+				mmsghdr messages[MaxBatchSize];
+				iovec vectors[MaxBatchSize * 2];
+				sockaddr_in addresses[MaxBatchSize];
+				memset(messages, 0, sizeof(mmsghdr) * batch);
+
+				const int segments = headers ? 2 : 1;
+				for (int i = 0; i < batch; ++i)
+				{
+					assert(packets[received + i].data);
+					iovec* vector = &vectors[i * segments];
+					if (headers)
+					{
+						vector->iov_base = headers + (received + i) * headerSize;
+						vector->iov_len = headerSize;
+						vector++;
+					}
+					vector->iov_base = packets[received + i].data;
+					vector->iov_len = size;
+					messages[i].msg_hdr.msg_name = &addresses[i];
+					messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+					messages[i].msg_hdr.msg_iov = &vectors[i * segments];
+					messages[i].msg_hdr.msg_iovlen = segments;
+				}
+
+				int result = recvmmsg(socket, messages, batch, MSG_DONTWAIT, NULL);
+				if (result <= 0)
+					break;
+
+				// compact out empty and truncated datagrams so the caller only sees real packets (their buffers are swapped to the back)
+
+				int kept = 0;
+				for (int i = 0; i < result; ++i)
+				{
+					if (messages[i].msg_len == 0 || (messages[i].msg_hdr.msg_flags & MSG_TRUNC))
+						continue;
+					Datagram& packet = packets[received + kept];
+					if (kept != i)
+					{
+						std::swap(packet.data, packets[received + i].data);
+						if (headers)
+							memcpy(headers + (received + kept) * headerSize, headers + (received + i) * headerSize, headerSize);
+					}
+					packet.address = Address(ntohl(addresses[i].sin_addr.s_addr), ntohs(addresses[i].sin_port));
+					packet.size = (int)messages[i].msg_len;
+					kept++;
+				}
+				received += kept;
+				if (result < batch)
+					break;
+			}
+			return received;
+		}
+
+		// gso path of SendBatch: each run of consecutive datagrams to one destination where all but the last have the
+		// size of the first goes out as one sendmsg with UDP_SEGMENT, gathered straight from the caller's buffers
+
+		int SendBatchOffload(const Datagram packets[], int count)
+		{
+			int sent = 0;
+			while (sent < count)
+			{
+				const Datagram& first = packets[sent];
+				int run = 1;
+				int bytes = first.size;
+				while (sent + run < count && run < MaxOffloadDatagrams)
+				{
+					const Datagram& next = packets[sent + run];
+					if (packets[sent + run - 1].size != first.size || next.size > first.size ||
+						next.address != first.address || bytes + next.size > MaxOffloadBytes)
+						break;
+					bytes += next.size;
+					run++;
+				}
+
+				sockaddr_in address;
+				address.sin_family = AF_INET;
+				address.sin_addr.s_addr = htonl(first.address.GetAddress());
+				address.sin_port = htons((unsigned short)first.address.GetPort());
+
+				iovec vectors[MaxOffloadDatagrams];
+				for (int i = 0; i < run; ++i)
+				{
+					vectors[i].iov_base = packets[sent + i].data;
+					vectors[i].iov_len = packets[sent + i].size;
+				}
+
+				unsigned short segment = (unsigned short)first.size;
+				char control[CMSG_SPACE(sizeof(segment))];
+				memset(control, 0, sizeof(control));
+
+				msghdr message;
+				memset(&message, 0, sizeof(message));
+				message.msg_name = &address;
+				message.msg_namelen = sizeof(sockaddr_in);
+				message.msg_iov = vectors;
+				message.msg_iovlen = run;
+				if (run > 1)
+				{
+					message.msg_control = control;
+					message.msg_controllen = sizeof(control);
+					cmsghdr* header = CMSG_FIRSTHDR(&message);
+					header->cmsg_level = IPPROTO_UDP;
+					header->cmsg_type = UDP_SEGMENT;
+					header->cmsg_len = CMSG_LEN(sizeof(segment));
+					memcpy(CMSG_DATA(header), &segment, sizeof(segment));
+				}
+
+				if (sendmsg(socket, &message, 0) != bytes)
+					break;
+				sent += run;
+			}
+			return sent;
+		}
+
+#endif
+
+		// next datagram from the last coalesced gro buffer, receiving a new buffer once it is used up
+		//  + datagrams that do not fit in the segments are skipped, returns 0 once the socket has nothing more
+
+		int ReceiveOffload(Address& sender, const Segment segments[], int count)
+		{
+#if defined(__linux__) && defined(UDP_GRO)
+			while (true)
+			{
+				if (offloadOffset >= offloadSize && !ReceiveCoalesced())
+					return 0;
+				const int bytes = std::min(offloadSegment, offloadSize - offloadOffset);
+				const unsigned char* datagram = &offloadBuffer[offloadOffset];
+				offloadOffset += bytes;
+				int offset = 0;
+				for (int i = 0; i < count && offset < bytes; ++i)
+				{
+					const int n = std::min(segments[i].size, bytes - offset);
+					memcpy(segments[i].data, datagram + offset, n);
+					offset += n;
+				}
+				if (offset < bytes)
+					continue;
+				sender = offloadSender;
+				return bytes;
+			}
+#else
+			return 0;
+#endif
+		}
+
+#if defined(__linux__) && defined(UDP_GRO)
+
+		bool ReceiveCoalesced()
+		{
+			sockaddr_in from;
+			iovec vector;
+			vector.iov_base = &offloadBuffer[0];
+			vector.iov_len = offloadBuffer.size();
+			char control[CMSG_SPACE(sizeof(int))];
+
+			msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_name = &from;
+			message.msg_namelen = sizeof(from);
+			message.msg_iov = &vector;
+			message.msg_iovlen = 1;
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+
+			const int received = (int)recvmsg(socket, &message, 0);
+			if (received <= 0)
+				return false;
+
+			// without a UDP_GRO control message the buffer holds a single datagram
+
+			offloadSegment = received;
+			for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header))
+			{
+				if (header->cmsg_level == IPPROTO_UDP && header->cmsg_type == UDP_GRO)
+				{
+					int segment = 0;
+					memcpy(&segment, CMSG_DATA(header), sizeof(segment));
+					if (segment > 0)
+						offloadSegment = segment;
+				}
+			}
+			offloadSender = Address(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+			offloadOffset = 0;
+			offloadSize = received;
+			return true;
+		}
+
+#endif
+
+		int socket;
+		bool txtime;		// SO_TXTIME enabled, SendAt passes departure times to the kernel
+		bool offload;		// UDP_SEGMENT sends and UDP_GRO receives enabled
+
+		std::vector<unsigned char> offloadBuffer;	// last coalesced gro receive
+		int offloadOffset;							// start of the next datagram in offloadBuffer
+		int offloadSize;							// bytes received into offloadBuffer
+		int offloadSegment;							// datagram size of the coalesced buffer
+		Address offloadSender;						// sender of the coalesced buffer
+
+#if defined(NET_IO_URING) && defined(__linux__)
+		UringBackend* ring;							// io_uring backend, NULL for plain socket calls
+#else
+		void* ring;
+#endif
+	};
+
+	// token bucket pacer to spread sends evenly at a target rate instead of bursting at frame boundaries
+	//  + tokens are bytes, refilled at the rate from the time passed in (use get_time for a monotonic clock)
+	//  + the bucket holds at most burst bytes so idle time cannot be saved up into a large burst
+
+	class Pacer
+	{
+	public:
+
+		Pacer(int burst = 2 * MaxDatagramSize)
+		{
+			assert(burst > 0);
+			this->burst = burst;
+			rate = 0.0f;
+			Reset(0.0);
+		}
+
+		void Reset(double time)
+		{
+			tokens = (float)burst;
+			last_time = time;
+		}
+
+		void SetRate(float bytes_per_second)
+		{
+			rate = bytes_per_second;
+		}
+
+		float GetRate() const
+		{
+			return rate;
+		}
+
+		bool CanSend(double time, int size)
+		{
+			Refill(time);
+			return tokens >= size;
+		}
+
+		void OnSent(int size)
+		{
+			tokens -= size;
+		}
+
+		// bytes that may be sent now
+
+		int GetBudget(double time)
+		{
+			Refill(time);
+			return tokens > 0.0f ? (int)tokens : 0;
+		}
+
+		// earliest time a packet of size bytes may be sent, for sleeping or kernel departure times
+
+		double GetNextSendTime(double time, int size)
+		{
+			Refill(time);
+			if (tokens >= size)
+				return time;
+			if (rate <= 0.0f)
+				return time + 1.0;
+			return time + (size - tokens) / rate;
+		}
+
+	private:
+
+		void Refill(double time)
+		{
+			if (time > last_time)
+			{
+				tokens += (float)((time - last_time) * rate);
+				if (tokens > burst)
+					tokens = (float)burst;
+			}
+			last_time = time;
+		}
+
+		int burst;				// bucket size in bytes
+		float rate;				// refill rate in bytes per second
+		float tokens;			// bytes that may be sent now
+		double last_time;		// time of the last refill
+	};
+
+	// reactor to block the main loop until a socket is readable or the next protocol deadline passes, instead of spinning
+	//  + on linux this is epoll plus a timerfd, so timeouts have sub-millisecond resolution rather than epoll_wait's milliseconds
+	//  + elsewhere it falls back to select on the same sockets
+
+	class Reactor
+	{
+	public:
+
+		Reactor()
+		{
+			epoll = -1;
+			timer = -1;
+			wakeup = -1;
+			open = false;
+		}
+
+		~Reactor()
+		{
+			Close();
+		}
+
+		bool Open()
+		{
+			assert(!open);
+#if defined(__linux__)
+			epoll = epoll_create1(EPOLL_CLOEXEC);
+			timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+			wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (epoll < 0 || timer < 0 || wakeup < 0)
+			{
+				printf("failed to create reactor\n");
+				Close();
+				return false;
+			}
+			epoll_event event;
+			event.events = EPOLLIN;
+			event.data.fd = timer;
+			epoll_event wake;
+			wake.events = EPOLLIN;
+			wake.data.fd = wakeup;
+			if (epoll_ctl(epoll, EPOLL_CTL_ADD, timer, &event) < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, wakeup, &wake) < 0)
+			{
+				printf("failed to add timer to reactor\n");
+				Close();
+				return false;
+			}
+#endif
+			open = true;
+			return true;
+		}
+
+		void Close()
+		{
+#if defined(__linux__)
+			if (wakeup >= 0)
+				close(wakeup);
+			if (timer >= 0)
+				close(timer);
+			if (epoll >= 0)
+				close(epoll);
+#endif
+			epoll = -1;
+			timer = -1;
+			wakeup = -1;
+			sockets.clear();
+			open = false;
+		}
+
+		bool IsOpen() const
+		{
+			return open;
+		}
+
+		// watch a socket for readability (level triggered, so a socket that is not fully drained wakes the next wait too)
+
+		bool Add(const Socket& socket)
+		{
+			assert(open);
+			assert(socket.IsOpen());
+#if defined(__linux__)
+			epoll_event event;
+			event.events = EPOLLIN;
+			event.data.fd = socket.GetWaitHandle();
+			if (epoll_ctl(epoll, EPOLL_CTL_ADD, socket.GetWaitHandle(), &event) < 0)
+			{
+				printf("failed to add socket to reactor\n");
+				return false;
+			}
+#endif
+			sockets.push_back(socket.GetWaitHandle());
+			return true;
+		}
+
+		// end a Wait in progress (or the next one) early, safe to call from any thread
+		//  + only supported on linux, elsewhere waits just run to their timeout and this returns false
+
+		bool Wake()
+		{
+#if defined(__linux__)
+			const unsigned long long increment = 1;
+			return write(wakeup, &increment, sizeof(increment)) == sizeof(increment);
+#else
+			return false;
+#endif
+		}
+
+		static bool CanWake()
+		{
+#if defined(__linux__)
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		// wait up to timeout seconds, returns true if a watched socket is readable
+		//  + a timeout of zero or less polls without blocking
+
+		bool Wait(float timeout)
+		{
+			assert(open);
+#if defined(__linux__)
+			if (timeout > 0.0f)
+			{
+				itimerspec spec;
+				memset(&spec, 0, sizeof(spec));
+				spec.it_value.tv_sec = (time_t)timeout;
+				spec.it_value.tv_nsec = (long)((timeout - (float)spec.it_value.tv_sec) * 1000000000.0f);
+				if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+					spec.it_value.tv_nsec = 1;
+				timerfd_settime(timer, 0, &spec, NULL);
+			}
+			epoll_event events[MaxEvents];
+			const int count = epoll_wait(epoll, events, MaxEvents, timeout > 0.0f ? -1 : 0);
+			bool readable = false;
+			for (int i = 0; i < count; ++i)
+			{
+				if (events[i].data.fd == timer || events[i].data.fd == wakeup)
+				{
+					unsigned long long expirations;
+					if (read(events[i].data.fd, &expirations, sizeof(expirations)) < 0)
+						continue;
+				}
+				else
+					readable = true;
+			}
+			return readable;
+#else
+			if (sockets.empty())
+			{
+				if (timeout > 0.0f)
+					wait(timeout);
+				return false;
+			}
+			fd_set readSet;
+			FD_ZERO(&readSet);
+			int maxSocket = 0;
+			for (size_t i = 0; i < sockets.size(); ++i)
+			{
+				FD_SET(sockets[i], &readSet);
+				maxSocket = std::max(maxSocket, sockets[i]);
+			}
+			if (timeout < 0.0f)
+				timeout = 0.0f;
+			timeval tv;
+			tv.tv_sec = (long)timeout;
+			tv.tv_usec = (long)((timeout - (float)tv.tv_sec) * 1000000.0f);
+			return select(maxSocket + 1, &readSet, NULL, NULL, &tv) > 0;
+#endif
+		}
+
+	private:
+
+		enum { MaxEvents = 16 };
+
+		int epoll;						// epoll instance (linux only)
+		int timer;						// timerfd armed with the wait timeout (linux only)
+		int wakeup;						// eventfd written by Wake (linux only)
+		bool open;
+		std::vector<int> sockets;		// watched socket handles
+	};
+
+	// connection
+	//  + SocketBackend carries the datagrams: Socket, or any type with its Open, Close, IsOpen, Flush, segment Send
+	//    and Receive and ReceiveBatch
+
+	template <class SocketBackend> class BasicConnection
+	{
+	public:
+
+		enum Mode
+		{
+			None,
+			Client,
+			Server
+		};
+
+		BasicConnection(unsigned int protocolId, float timeout)
+		{
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			mode = None;
+			running = false;
+			transport = &socket;
+			batchHeaderSize = 0;
+			formatMask = 0;
+			packetFormat = 0;
+			ClearData();
+		}
+
+		virtual ~BasicConnection()
+		{
+			if (IsRunning())
+				Stop();
+		}
+
+		bool Start(int port)
+		{
+			assert(!running);
+			printf("start connection on port %d\n", port);
+			if (!socket.Open(port))
+				return false;
+			running = true;
+			OnStart();
+			return true;
+		}
+
+		// start on a socket owned by someone else, e.g. one server socket shared by every peer of a ConnectionManager
+		//  + packets are sent through the shared socket, received packets are handed in with ProcessPacket
+
+		void Attach(SocketBackend& shared)
+		{
+			assert(!running);
+			assert(shared.IsOpen());
+			transport = &shared;
+			running = true;
+			OnStart();
+		}
+
+		void Stop()
+		{
+			assert(running);
+			printf("stop connection\n");
+			bool connected = IsConnected();
+			ClearData();
+			socket.Close();
+			transport = &socket;
+			running = false;
+			if (connected)
+				OnDisconnect();
+			OnStop();
+		}
+
+		bool IsRunning() const
+		{
+			return running;
+		}
+
+		void Listen()
+		{
+			printf("server listening for connection\n");
+			bool connected = IsConnected();
+			ClearData();
+			if (connected)
+				OnDisconnect();
+			mode = Server;
+			state = Listening;
+		}
+
+		void Connect(const Address& address)
+		{
+			printf("client connecting to %d.%d.%d.%d:%d\n",
+				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
+			bool connected = IsConnected();
+			ClearData();
+			if (connected)
+				OnDisconnect();
+			mode = Client;
+			state = Connecting;
+			this->address = address;
+		}
+
+		bool IsConnecting() const
+		{
+			return state == Connecting;
+		}
+
+		bool ConnectFailed() const
+		{
+			return state == ConnectFail;
+		}
+
+		bool IsConnected() const
+		{
+			return state == Connected;
+		}
+
+		bool IsListening() const
+		{
+			return state == Listening;
+		}
+
+		Mode GetMode() const
+		{
+			return mode;
+		}
+
+		const SocketBackend& GetSocket() const
+		{
+			return *transport;
+		}
+
+		SocketBackend& GetSocket()
+		{
+			return *transport;
+		}
+
+		const Address& GetAddress() const
+		{
+			return address;
+		}
+
+		// seconds until Update next has work to do without a packet arriving, for sleeping in a reactor
+		//  + the base connection only has its timeout, derived connections add their own deadlines
+
+		virtual float GetTimeUntilNextUpdate() const
+		{
+			if (state != Connecting && state != Connected)
+				return timeout;
+			return std::max(timeout - timeoutAccumulator, 0.0f);
+		}
+
+		virtual void Update(float deltaTime)
+		{
+			assert(running);
+			timeoutAccumulator += deltaTime;
+			if (timeoutAccumulator > timeout)
+			{
+				if (state == Connecting)
+				{
+					printf("connect timed out\n");
+					ClearData();
+					state = ConnectFail;
+					OnDisconnect();
+				}
+				else if (state == Connected)
+				{
+					printf("connection timed out\n");
+					ClearData();
+					if (state == Connecting)
+						state = ConnectFail;
+					OnDisconnect();
+				}
+			}
+			Flush();
+		}
+
+		virtual bool SendPacket(const unsigned char data[], int size)
+		{
+			return SendPacket(NULL, 0, data, size);
+		}
+
+		virtual int ReceivePacket(unsigned char data[], int size)
+		{
+			return ReceivePacket(NULL, 0, data, size);
+		}
+
+		// pooled variants: the payload is sent from, or received into, a buffer that can be held without copying
+
+		bool SendPacket(const PacketHandle& packet)
+		{
+			return SendPacket(NULL, 0, packet.GetData(), packet.GetSize());
+		}
+
+		int ReceivePacket(PacketHandle& packet)
+		{
+			packet.MakeUnique();
+			const int received = ReceivePacket(NULL, 0, packet.GetData(), packet.GetCapacity());
+			packet.SetSize(received > 0 ? received : 0);
+			return packet.GetSize();
+		}
+
+		// handle a datagram received by someone else on our behalf, returns true if it is for us
+		//  + header points at the start of the datagram (protocol id, then any header of a derived connection) and bytes
+		//    is the whole datagram size, the payload stays wherever the receiver put it
+
+		bool ProcessPacket(const Address& sender, const unsigned char header[], int bytes)
+		{
+			assert(running);
+			return AcceptPacket(sender, header, bytes);
+		}
+
+		// drain up to count packets from the socket in one go, returns the number of packets accepted
+		//  + each packets[i].data must hold size bytes, on return address and size are filled in for accepted packets
+		//  + payloads are received straight into the caller's buffers, which may be swapped around to compact out rejected packets
+		//  + datagrams, if given, is set to the number read from the socket, accepted or not. a batch can accept nothing
+		//    and still not have emptied the socket, so drain loops stop when this is 0
+
+		virtual int ReceivePackets(Datagram packets[], int count, int size, int* datagrams = NULL)
+		{
+			return ReceivePackets(packets, count, size, 0, -1, datagrams);
+		}
+
+		int GetHeaderSize() const
+		{
+			return 4;
+		}
+
+	protected:
+
+		virtual void OnStart() {}
+		virtual void OnStop() {}
+		virtual void OnConnect() {}
+		virtual void OnDisconnect() {}
+
+		// submit sends queued by the socket backend, unless the socket is shared and its owner flushes once for everyone
+
+		void Flush()
+		{
+			if (transport == &socket)
+				socket.Flush();
+		}
+
+		// the low bits of the protocol id selected by mask tag the format of what follows it instead of identifying the protocol
+		//  + packets are accepted whatever their format bits, GetPacketFormat says which one arrived
+
+		void SetFormatMask(unsigned int mask)
+		{
+			formatMask = mask;
+		}
+
+		// format of the last accepted packet, or of the packet whose protocol id is at id
+
+		unsigned int GetPacketFormat() const
+		{
+			return packetFormat;
+		}
+
+		unsigned int GetPacketFormat(const unsigned char id[]) const
+		{
+			return (id[3] ^ protocolId) & formatMask;
+		}
+
+		// send a header and payload behind the protocol id as separate segments, so neither is copied into a packet buffer
+
+		bool SendPacket(const unsigned char header[], int headerSize, const unsigned char data[], int size, unsigned int format = 0)
+		{
+			assert(running);
+			assert(headerSize >= 0);
+			assert(size >= 0);
+			if (address.GetAddress() == 0)
+				return false;
+			if (4 + headerSize + size > MaxDatagramSize)
+				return false;
+			assert((format & ~formatMask) == 0);
+			const unsigned int tagged = protocolId ^ format;
+			unsigned char id[4];
+			id[0] = (unsigned char)(tagged >> 24);
+			id[1] = (unsigned char)((tagged >> 16) & 0xFF);
+			id[2] = (unsigned char)((tagged >> 8) & 0xFF);
+			id[3] = (unsigned char)((tagged) & 0xFF);
+			Segment segments[3];
+			int count = 0;
+			segments[count].data = id;
+			segments[count++].size = 4;
+			if (headerSize > 0)
+			{
+				segments[count].data = const_cast<unsigned char*>(header);
+				segments[count++].size = headerSize;
+			}
+			if (size > 0)
+			{
+				segments[count].data = const_cast<unsigned char*>(data);
+				segments[count++].size = size;
+			}
+			return transport->Send(address, segments, count);
+		}
+
+		// receive a packet with the headerSize bytes after the protocol id scattered into header and the payload into data
+		//  + returns the header plus payload size, or 0 if nothing was received, the packet is not for us or it did not fit
+
+		int ReceivePacket(unsigned char header[], int headerSize, unsigned char data[], int size)
+		{
+			assert(running);
+			assert(headerSize >= 0);
+			unsigned char id[4];
+			Segment segments[3];
+			int count = 0;
+			segments[count].data = id;
+			segments[count++].size = 4;
+			if (headerSize > 0)
+			{
+				segments[count].data = header;
+				segments[count++].size = headerSize;
+			}
+			segments[count].data = data;
+			segments[count++].size = size;
+			Address sender;
+			int bytes_read = transport->Receive(sender, segments, count);
+			if (bytes_read == 0)
+				return 0;
+			if (!AcceptPacket(sender, id, bytes_read))
+				return 0;
+			return bytes_read - 4;
+		}
+
+		// batch receive with the headerSize bytes after each protocol id kept aside, see GetBatchHeader
+		//  + packets with no more than minimumHeaderSize bytes after the protocol id are rejected (by default headerSize,
+		//    so every accepted packet has a payload). size is set to the bytes past the header region of accepted packets,
+		//    zero or less for a packet that ended inside it
+
+		int ReceivePackets(Datagram packets[], int count, int size, int headerSize, int minimumHeaderSize = -1, int* datagrams = NULL)
+		{
+			assert(running);
+			assert(packets);
+			assert(headerSize >= 0);
+			if (minimumHeaderSize < 0)
+				minimumHeaderSize = headerSize;
+			const int stride = 4 + headerSize;
+			if ((int)batchHeaders.size() < count * stride)
+				batchHeaders.resize(count * stride);
+			int received = transport->ReceiveBatch(packets, count, size, &batchHeaders[0], stride);
+			if (datagrams)
+				*datagrams = received;
+			int accepted = 0;
+			for (int i = 0; i < received; ++i)
+			{
+				unsigned char* header = &batchHeaders[i * stride];
+				const int payload_bytes = packets[i].size - stride;
+				if (packets[i].size - 4 <= minimumHeaderSize || !AcceptPacket(packets[i].address, header, packets[i].size))
+					continue;
+				if (accepted != i)
+				{
+					std::swap(packets[accepted].data, packets[i].data);
+					packets[accepted].address = packets[i].address;
+					memcpy(&batchHeaders[accepted * stride], header, stride);
+				}
+				packets[accepted].size = payload_bytes;
+				accepted++;
+			}
+			batchHeaderSize = headerSize;
+			return accepted;
+		}
+
+		// header of accepted packet index from the last batch receive, parsed in place
+
+		const unsigned char* GetBatchHeader(int index) const
+		{
+			return &batchHeaders[index * (4 + batchHeaderSize) + 4];
+		}
+
+		unsigned int GetBatchFormat(int index) const
+		{
+			return GetPacketFormat(&batchHeaders[index * (4 + batchHeaderSize)]);
+		}
+
+		// validate protocol id and connection state for a received packet, true if its payload is for us
+
+		bool AcceptPacket(const Address& sender, const unsigned char packet[], int bytes_read)
+		{
+			if (bytes_read <= 4)
+				return false;
+			const unsigned int id = ((unsigned int)packet[0] << 24) | ((unsigned int)packet[1] << 16) |
+				((unsigned int)packet[2] << 8) | (unsigned int)packet[3];
+			if ((id ^ protocolId) & ~formatMask)
+				return false;
+			if (mode == Server && !IsConnected())
+			{
+				printf("server accepts connection from client %d.%d.%d.%d:%d\n",
+					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
+				state = Connected;
+				address = sender;
+				OnConnect();
+			}
+			if (sender != address)
+				return false;
+			if (mode == Client && state == Connecting)
+			{
+				printf("client completes connection with server\n");
+				state = Connected;
+				OnConnect();
+			}
+			timeoutAccumulator = 0.0f;
+			packetFormat = (id ^ protocolId) & formatMask;
+			return true;
+		}
+
+	private:
+
+		void ClearData()
+		{
+			state = Disconnected;
+			timeoutAccumulator = 0.0f;
+			address = Address();
+		}
+
+		enum State
+		{
+			Disconnected,
+			Listening,
+			Connecting,
+			ConnectFail,
+			Connected
+		};
+
+		unsigned int protocolId;
+		float timeout;
+
+		bool running;
+		Mode mode;
+		State state;
+		SocketBackend socket;
+		SocketBackend* transport;			// socket packets go through, our own or one shared with other connections
+		float timeoutAccumulator;
+		Address address;
+		std::vector<unsigned char> batchHeaders;	// protocol id and header of each packet in the last batch (grows once, then reused)
+		int batchHeaderSize;						// header bytes after each protocol id in batchHeaders
+		unsigned int formatMask;					// protocol id bits that tag the packet format
+		unsigned int packetFormat;					// format bits of the last accepted packet
+	};
+
+	typedef BasicConnection<Socket> Connection;
+
+	// packet queue to store information about sent and received packets sorted in sequence order
+	//  + we define ordering using the "sequence_more_recent" function, this works provided there is a large gap when sequence wrap occurs
+	//  + stored in a fixed power of two ring indexed by sequence % capacity: insert, lookup and remove are O(1) and never allocate
+	//  + the queue covers a window of at most capacity consecutive sequence numbers, older entries are evicted as newer ones arrive
+	//  + max_sequence + 1 must be a multiple of the capacity so that wrapped sequence numbers map to distinct slots
+
+	struct PacketData
+	{
+		unsigned int sequence;			// packet sequence number
+		double time;					// time packet was sent or received (depending on context), on the owner's clock
+		int size;						// packet size in bytes
+	};
+
+	inline bool sequence_more_recent(unsigned int s1, unsigned int s2, unsigned int max_sequence)
+	{
+		auto half_max = max_sequence / 2;
+		return (
+			((s1 > s2) && (s1 - s2 <= half_max))
+			||
+			((s2 > s1) && (s2 - s1 > half_max))
+			);
+	}
+
+	// number of steps forward from one sequence to another, taking wrap around into account
+
+	inline unsigned int sequence_distance(unsigned int from, unsigned int to, unsigned int max_sequence)
+	{
+		return to >= from ? to - from : to + (max_sequence - from) + 1;
+	}
+
+	const unsigned int DefaultPacketQueueCapacity = 1024;
+
+	// delayed acks: a received packet is acked by the next packet sent, or by a standalone ack once this many packets
+	// are waiting for one or the oldest has waited this many seconds
+
+	const int DefaultAckFrequency = 2;
+	const float DefaultAckDelay = 0.05f;
+
+	class PacketQueue
+	{
+		struct Entry
+		{
+			PacketData data;
+			bool valid;
+		};
+
+	public:
+
+		// iterates entries from oldest to most recent sequence
+
+		template <typename Queue, typename Data> class basic_iterator
+		{
+		public:
+
+			basic_iterator(Queue* queue, unsigned int sequence, int remaining)
+			{
+				this->queue = queue;
+				this->sequence = sequence;
+				this->remaining = remaining;
+			}
+
+			Data& operator * () const
+			{
+				return queue->entries[sequence & queue->mask].data;
+			}
+
+			Data* operator -> () const
+			{
+				return &queue->entries[sequence & queue->mask].data;
+			}
+
+			basic_iterator& operator ++ ()
+			{
+				assert(remaining > 0);
+				if (--remaining > 0)
+				{
+					do
+						sequence = queue->next_sequence(sequence);
+					while (!queue->entries[sequence & queue->mask].valid);
+				}
+				return *this;
+			}
+
+			basic_iterator operator ++ (int)
+			{
+				basic_iterator result = *this;
+				++*this;
+				return result;
+			}
+
+			bool operator == (const basic_iterator& other) const
+			{
+				return remaining == other.remaining;
+			}
+
+			bool operator != (const basic_iterator& other) const
+			{
+				return remaining != other.remaining;
+			}
+
+		private:
+
+			Queue* queue;
+			unsigned int sequence;
+			int remaining;
+		};
+
+		typedef basic_iterator<PacketQueue, PacketData> iterator;
+		typedef basic_iterator<const PacketQueue, const PacketData> const_iterator;
+
+		PacketQueue()
+		{
+			mask = 0;
+			max_sequence = 0xFFFFFFFF;
+			clear();
+		}
+
+		void init(unsigned int capacity, unsigned int max_sequence)
+		{
+			assert(capacity > 0);
+			assert((capacity & (capacity - 1)) == 0);
+			assert(max_sequence == 0xFFFFFFFF || (max_sequence + 1) % capacity == 0);
+			entries.assign(capacity, Entry());
+			mask = capacity - 1;
+			this->max_sequence = max_sequence;
+			clear();
+		}
+
+		void clear()
+		{
+			for (size_t i = 0; i < entries.size(); ++i)
+				entries[i].valid = false;
+			first = 0;
+			last = 0;
+			count = 0;
+			total_bytes = 0;
+		}
+
+		bool empty() const
+		{
+			return count == 0;
+		}
+
+		int size() const
+		{
+			return count;
+		}
+
+		int bytes() const
+		{
+			return total_bytes;
+		}
+
+		unsigned int capacity() const
+		{
+			return mask + 1;
+		}
+
+		bool exists(unsigned int sequence) const
+		{
+			return find(sequence) != NULL;
+		}
+
+		PacketData* find(unsigned int sequence)
+		{
+			Entry& entry = entries[sequence & mask];
+			return entry.valid && entry.data.sequence == sequence ? &entry.data : NULL;
+		}
+
+		const PacketData* find(unsigned int sequence) const
+		{
+			const Entry& entry = entries[sequence & mask];
+			return entry.valid && entry.data.sequence == sequence ? &entry.data : NULL;
+		}
+
+		PacketData& front()
+		{
+			assert(count > 0);
+			return entries[first & mask].data;
+		}
+
+		PacketData& back()
+		{
+			assert(count > 0);
+			return entries[last & mask].data;
+		}
+
+		const PacketData& front() const
+		{
+			assert(count > 0);
+			return entries[first & mask].data;
+		}
+
+		const PacketData& back() const
+		{
+			assert(count > 0);
+			return entries[last & mask].data;
+		}
+
+		iterator begin()
+		{
+			return iterator(this, first, count);
+		}
+
+		iterator end()
+		{
+			return iterator(this, 0, 0);
+		}
+
+		const_iterator begin() const
+		{
+			return const_iterator(this, first, count);
+		}
+
+		const_iterator end() const
+		{
+			return const_iterator(this, 0, 0);
+		}
+
+		// insert a packet in sequence order, returns the number of old entries evicted to make room
+		//  + packets older than the window or already in the queue are ignored
+
+		int insert_sorted(const PacketData& p)
+		{
+			assert(!entries.empty());
+			assert(p.sequence <= max_sequence);
+
+			if (count == 0)
+			{
+				first = last = p.sequence;
+				store(p);
+				return 0;
+			}
+
+			int evicted = 0;
+
+			if (sequence_more_recent(p.sequence, last, max_sequence))
+			{
+				while (count > 0 && (first == p.sequence || sequence_distance(first, p.sequence, max_sequence) > mask))
+				{
+					pop_front();
+					evicted++;
+				}
+				if (count == 0)
+					first = p.sequence;
+				last = p.sequence;
+			}
+			else if (sequence_more_recent(first, p.sequence, max_sequence))
+			{
+				if (sequence_distance(p.sequence, last, max_sequence) > mask)
+					return 0;
+				first = p.sequence;
+			}
+			else if (exists(p.sequence))
+			{
+				return 0;
+			}
+
+			store(p);
+			return evicted;
+		}
+
+		void pop_front()
+		{
+			assert(count > 0);
+			remove(first);
+		}
+
+		void remove(unsigned int sequence)
+		{
+			Entry& entry = entries[sequence & mask];
+			if (!entry.valid || entry.data.sequence != sequence)
+				return;
+			entry.valid = false;
+			total_bytes -= entry.data.size;
+			if (--count == 0)
+				return;
+			if (sequence == first)
+			{
+				do
+					first = next_sequence(first);
+				while (!entries[first & mask].valid);
+			}
+			else if (sequence == last)
+			{
+				do
+					last = previous_sequence(last);
+				while (!entries[last & mask].valid);
+			}
+		}
+
+		void verify_sorted() const
+		{
+			int found = 0;
+			const PacketData* prev = NULL;
+			for (const_iterator itor = begin(); itor != end(); itor++)
+			{
+				assert(itor->sequence <= max_sequence);
+				assert(find(itor->sequence) == &*itor);
+				if (prev)
+					assert(sequence_more_recent(itor->sequence, prev->sequence, max_sequence));
+				prev = &*itor;
+				found++;
+			}
+			assert(found == count);
+			assert(count == 0 || sequence_distance(first, last, max_sequence) <= mask);
+		}
+
+	private:
+
+		void store(const PacketData& p)
+		{
+			Entry& entry = entries[p.sequence & mask];
+			assert(!entry.valid);
+			entry.data = p;
+			entry.valid = true;
+			count++;
+			total_bytes += p.size;
+		}
+
+		unsigned int next_sequence(unsigned int sequence) const
+		{
+			return sequence == max_sequence ? 0 : sequence + 1;
+		}
+
+		unsigned int previous_sequence(unsigned int sequence) const
+		{
+			return sequence == 0 ? max_sequence : sequence - 1;
+		}
+
+		std::vector<Entry> entries;		// ring of capacity entries, allocated once by init
+		unsigned int mask;				// capacity - 1
+		unsigned int max_sequence;		// maximum sequence value before wrap around
+		unsigned int first;				// oldest sequence in the queue (valid when count > 0)
+		unsigned int last;				// most recent sequence in the queue (valid when count > 0)
+		int count;						// number of valid entries
+		int total_bytes;				// sum of entry sizes, so bandwidth stats never walk the queue
+	};
+
+	// ack bitfield sent in each packet header, bit n set means sequence ack - 1 - n was received
+	//  + kept as an array of 32 bit words so shifts and merges work a word at a time
+	//  + word 0 holds the most recent sequences and is the only word when Bits is 32
+
+	template <int Bits> class AckBitmap
+	{
+	public:
+
+		static_assert(Bits == 32 || Bits == 64 || Bits == 128 || Bits == 256, "ack bitmap must be 32, 64, 128 or 256 bits");
+
+		enum
+		{
+			Size = Bits,
+			Words = Bits / 32,
+			Bytes = Bits / 8
+		};
+
+		AckBitmap()
+		{
+			clear();
+		}
+
+		void clear()
+		{
+			for (int i = 0; i < Words; ++i)
+				words[i] = 0;
+		}
+
+		bool test(int bit_index) const
+		{
+			assert(bit_index >= 0 && bit_index < Bits);
+			return (words[bit_index >> 5] >> (bit_index & 31)) & 1;
+		}
+
+		void set(int bit_index)
+		{
+			assert(bit_index >= 0 && bit_index < Bits);
+			words[bit_index >> 5] |= 1u << (bit_index & 31);
+		}
+
+		// move every bit n places towards older sequences, bits shifted past the end are dropped
+
+		void shift(unsigned int n)
+		{
+			if (n >= (unsigned int)Bits)
+			{
+				clear();
+				return;
+			}
+			const int word_shift = (int)(n >> 5);
+			const int bit_shift = (int)(n & 31);
+			for (int i = Words - 1; i >= 0; --i)
+			{
+				const int source = i - word_shift;
+				unsigned int value = source >= 0 ? words[source] << bit_shift : 0;
+				if (bit_shift && source >= 1)
+					value |= words[source - 1] >> (32 - bit_shift);
+				words[i] = value;
+			}
+		}
+
+		unsigned int GetWord(int index) const
+		{
+			assert(index >= 0 && index < Words);
+			return words[index];
+		}
+
+		void SetWord(int index, unsigned int value)
+		{
+			assert(index >= 0 && index < Words);
+			words[index] = value;
+		}
+
+	private:
+
+		unsigned int words[Words];
+	};
+
+	typedef AckBitmap<NET_ACK_BITS> AckBits;
+
+	// windowed min or max filter over time (kathleen nichols' algorithm, as used by linux and bbr)
+	//  + keeps the best sample plus the best from the later thirds of the window, so expiry never scans history
+	//  + Compare(a, b) is true when sample a is at least as good as b, e.g. std::less_equal for a running minimum
+
+	template <typename Compare> class WindowedFilter
+	{
+	public:
+
+		WindowedFilter(double window)
+		{
+			this->window = window;
+			Reset();
+		}
+
+		void Reset()
+		{
+			empty = true;
+			for (int i = 0; i < 3; ++i)
+			{
+				samples[i].value = 0.0f;
+				samples[i].time = 0.0;
+			}
+		}
+
+		bool IsEmpty() const
+		{
+			return empty;
+		}
+
+		float Get() const
+		{
+			return samples[0].value;
+		}
+
+		float Update(float value, double time)
+		{
+			const Compare better = Compare();
+			const Sample sample = { value, time };
+
+			if (empty || better(value, samples[0].value) || time - samples[2].time > window)
+			{
+				empty = false;
+				samples[0] = samples[1] = samples[2] = sample;
+				return value;
+			}
+
+			if (better(value, samples[1].value))
+				samples[2] = samples[1] = sample;
+			else if (better(value, samples[2].value))
+				samples[2] = sample;
+
+			const double age = time - samples[0].time;
+			if (age > window)
+			{
+				samples[0] = samples[1];
+				samples[1] = samples[2];
+				samples[2] = sample;
+				if (time - samples[0].time > window)
+				{
+					samples[0] = samples[1];
+					samples[1] = samples[2];
+					samples[2] = sample;
+				}
+			}
+			else if (samples[1].time == samples[0].time && age > window / 4)
+			{
+				samples[2] = samples[1] = sample;
+			}
+			else if (samples[2].time == samples[1].time && age > window / 2)
+			{
+				samples[2] = sample;
+			}
+
+			return samples[0].value;
+		}
+
+	private:
+
+		struct Sample
+		{
+			float value;
+			double time;
+		};
+
+		double window;			// window length in seconds
+		bool empty;				// no samples since reset
+		Sample samples[3];		// best, second best and third best samples
+	};
+
+	// round trip time estimator following rfc 6298
+	//  + smoothed rtt and rtt variance give the retransmission timeout (rto) used to declare packets lost
+	//  + rto backs off exponentially on timeouts until a new sample arrives
+	//  + resent payloads always go out under a new sequence, so every sample is unambiguous (no karn filtering needed)
+
+	const float MinRttWindow = 10.0f;
+
+	class RttEstimator
+	{
+	public:
+
+		RttEstimator() : minimumRtt(MinRttWindow)
+		{
+			minimum_rto = 0.02f;
+			maximum_rto = 60.0f;
+			Reset();
+		}
+
+		void Reset()
+		{
+			srtt = 0.0f;
+			rttvar = 0.0f;
+			rto = 1.0f;
+			granularity = 0.0f;
+			has_sample = false;
+			minimumRtt.Reset();
+		}
+
+		void AddSample(float sample, double time)
+		{
+			const float alpha = 1.0f / 8.0f;
+			const float beta = 1.0f / 4.0f;
+
+			if (!has_sample)
+			{
+				srtt = sample;
+				rttvar = sample / 2.0f;
+				has_sample = true;
+			}
+			else
+			{
+				const float error = srtt > sample ? srtt - sample : sample - srtt;
+				rttvar = (1.0f - beta) * rttvar + beta * error;
+				srtt = (1.0f - alpha) * srtt + alpha * sample;
+			}
+
+			minimumRtt.Update(sample, time);
+			rto = srtt + (granularity > 4.0f * rttvar ? granularity : 4.0f * rttvar);
+			ClampRto();
+		}
+
+		void Backoff()
+		{
+			rto *= 2.0f;
+			ClampRto();
+		}
+
+		// timer granularity, the interval between updates that check for timeouts
+
+		void SetGranularity(float seconds)
+		{
+			granularity = seconds;
+		}
+
+		void SetRtoBounds(float minimum, float maximum)
+		{
+			assert(minimum > 0.0f && minimum <= maximum);
+			minimum_rto = minimum;
+			maximum_rto = maximum;
+			ClampRto();
+		}
+
+		bool HasSample() const
+		{
+			return has_sample;
+		}
+
+		float GetSmoothedRtt() const
+		{
+			return srtt;
+		}
+
+		float GetRttVariance() const
+		{
+			return rttvar;
+		}
+
+		float GetMinRtt() const
+		{
+			return minimumRtt.Get();
+		}
+
+		float GetRto() const
+		{
+			return rto;
+		}
+
+		// round trip time to spread a window over when pacing: smoothed rtt once sampled, the initial rto before that
+
+		float GetPacingRtt() const
+		{
+			if (!has_sample)
+				return rto;
+			return srtt > 0.001f ? srtt : 0.001f;
+		}
+
+	private:
+
+		void ClampRto()
+		{
+			if (rto < minimum_rto)
+				rto = minimum_rto;
+			if (rto > maximum_rto)
+				rto = maximum_rto;
+		}
+
+		float srtt;										// smoothed round trip time
+		float rttvar;									// round trip time variance
+		float rto;										// retransmission timeout (1 second until the first sample)
+		float granularity;								// clock granularity added to the rto
+		float minimum_rto;								// lower bound on rto
+		float maximum_rto;								// upper bound on rto
+		bool has_sample;								// true once a sample has been taken
+		WindowedFilter<std::less_equal<float> > minimumRtt;	// minimum rtt over the last MinRttWindow seconds
+	};
+
+	// congestion control interface driven by reliability system send, ack and loss events
+	//  + implementations decide a congestion window (bytes allowed in flight) and a pacing rate (bytes per second)
+	//  + times are on the reliability system clock, sizes are whole datagram sizes
+
+	class CongestionControl
+	{
+	public:
+
+		virtual ~CongestionControl() {}
+
+		virtual void Reset() = 0;
+
+		virtual void OnPacketSent(double time, unsigned int sequence, int size, int bytes_in_flight) = 0;
+
+		virtual void OnPacketAcked(double time, unsigned int sequence, double sent_time, int size, int bytes_in_flight, const RttEstimator& rtt) = 0;
+
+		virtual void OnPacketLost(double time, unsigned int sequence, double sent_time, int size, int bytes_in_flight) = 0;
+
+		virtual int GetCongestionWindow() const = 0;
+
+		virtual float GetPacingRate(const RttEstimator& rtt) const = 0;
+	};
+
+	const int InitialCongestionWindow = 10;			// initial window in full size datagrams
+	const int MinimumCongestionWindow = 2;			// smallest window in full size datagrams
+	const float BbrHighGain = 2.885f;				// 2/ln(2), doubles the bbr sending rate each round in startup
+
+	// loss based congestion control: slow start, then cubic window growth (rfc 8312) with a reno friendly floor
+	//  + one multiplicative decrease per round trip: losses of packets sent before the last decrease are ignored
+	//  + the window only grows while the sender is actually using at least half of it
+
+	class CubicCongestionControl : public CongestionControl
+	{
+	public:
+
+		CubicCongestionControl()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			cwnd = (float)InitialCongestionWindow;
+			ssthresh = 1.0e9f;
+			w_max = 0.0f;
+			w_est = 0.0f;
+			k = 0.0f;
+			epoch_start = -1.0;
+			recovery_start = -1.0;
+		}
+
+		void OnPacketSent(double time, unsigned int sequence, int size, int bytes_in_flight) {}
+
+		void OnPacketAcked(double time, unsigned int sequence, double sent_time, int size, int bytes_in_flight, const RttEstimator& rtt)
+		{
+			if (sent_time <= recovery_start)
+				return;
+			if (bytes_in_flight * 2 < GetCongestionWindow())
+				return;
+
+			const float acked = (float)size / MaxDatagramSize;
+
+			if (cwnd < ssthresh)
+			{
+				cwnd += acked;
+				return;
+			}
+
+			const float C = 0.4f;
+			const float beta = 0.7f;
+
+			if (epoch_start < 0.0)
+			{
+				epoch_start = time;
+				k = cwnd < w_max ? cbrtf((w_max - cwnd) / C) : 0.0f;
+				if (cwnd > w_max)
+					w_max = cwnd;
+				w_est = cwnd;
+			}
+
+			const float t = (float)(time - epoch_start) + rtt.GetMinRtt();
+			const float target = w_max + C * (t - k) * (t - k) * (t - k);
+
+			if (target > cwnd)
+				cwnd += (target - cwnd) / cwnd * acked;
+			else
+				cwnd += 0.01f / cwnd * acked;
+
+			w_est += 3.0f * (1.0f - beta) / (1.0f + beta) * acked / cwnd;
+			if (w_est > cwnd)
+				cwnd = w_est;
+		}
+
+		void OnPacketLost(double time, unsigned int sequence, double sent_time, int size, int bytes_in_flight)
+		{
+			if (sent_time <= recovery_start)
+				return;
+
+			const float beta = 0.7f;
+
+			// fast convergence: release bandwidth sooner when the window keeps shrinking
+
+			w_max = cwnd < w_max ? cwnd * (1.0f + beta) / 2.0f : cwnd;
+			cwnd *= beta;
+			if (cwnd < MinimumCongestionWindow)
+				cwnd = (float)MinimumCongestionWindow;
+			ssthresh = cwnd;
+			epoch_start = -1.0;
+			recovery_start = time;
+		}
+
+		int GetCongestionWindow() const
+		{
+			return (int)(cwnd * MaxDatagramSize);
+		}
+
+		// pace at the window per smoothed rtt, faster in slow start so the window can actually double
+
+		float GetPacingRate(const RttEstimator& rtt) const
+		{
+			const float gain = cwnd < ssthresh ? 2.0f : 1.25f;
+			return gain * GetCongestionWindow() / rtt.GetPacingRtt();
+		}
+
+	private:
+
+		float cwnd;					// congestion window in full size datagrams
+		float ssthresh;				// slow start threshold in full size datagrams
+		float w_max;				// window before the last decrease
+		float w_est;				// reno friendly window estimate
+		float k;					// time for the cubic curve to return to w_max
+		double epoch_start;			// start of the current growth epoch (negative when none)
+		double recovery_start;		// time of the last decrease (negative when none)
+	};
+
+	// model based congestion control in the style of bbr (v1)
+	//  + estimates bottleneck bandwidth (windowed max of delivery rate samples) and min rtt, paces at gain * bandwidth
+	//  + window is a multiple of the bandwidth delay product, loss is not a congestion signal
+	//  + delivery rate samples need the delivered count at send time, kept per sequence in a ring sized to the window
+
+	class BbrCongestionControl : public CongestionControl
+	{
+	public:
+
+		BbrCongestionControl(unsigned int window_size = DefaultPacketQueueCapacity)
+			: bandwidthFilter(10.0)
+		{
+			assert((window_size & (window_size - 1)) == 0);
+			sendStates.resize(window_size);
+			Reset();
+		}
+
+		void Reset()
+		{
+			for (size_t i = 0; i < sendStates.size(); ++i)
+				sendStates[i].valid = false;
+			bandwidthFilter.Reset();
+			state = Startup;
+			delivered = 0;
+			delivered_time = 0.0;
+			first_sent_time = 0.0;
+			next_round_delivered = 0;
+			round_count = 0;
+			full_bandwidth = 0.0f;
+			full_bandwidth_count = 0;
+			filled_pipe = false;
+			min_rtt = -1.0f;
+			min_rtt_stamp = 0.0;
+			probe_rtt_done = -1.0;
+			cycle_index = 0;
+			cycle_stamp = 0.0;
+			pacing_gain = BbrHighGain;
+			cwnd_gain = BbrHighGain;
+		}
+
+		void OnPacketSent(double time, unsigned int sequence, int size, int bytes_in_flight)
+		{
+			if (bytes_in_flight == 0)
+				first_sent_time = delivered_time = time;
+			SendState& send = sendStates[sequence & (sendStates.size() - 1)];
+			send.sequence = sequence;
+			send.delivered = delivered;
+			send.delivered_time = delivered_time;
+			send.first_sent_time = first_sent_time;
+			send.valid = true;
+		}
+
+		void OnPacketAcked(double time, unsigned int sequence, double sent_time, int size, int bytes_in_flight, const RttEstimator& rtt)
+		{
+			delivered += size;
+			delivered_time = time;
+
+			SendState& send = sendStates[sequence & (sendStates.size() - 1)];
+			const bool have_state = send.valid && send.sequence == sequence;
+			send.valid = false;
+
+			// round trips are counted in deliveries: a round ends when a packet sent after it started is acked
+
+			bool round_start = false;
+			if (have_state && send.delivered >= next_round_delivered)
+			{
+				next_round_delivered = delivered;
+				round_count++;
+				round_start = true;
+			}
+
+			// delivery rate sample over the longer of the send and ack intervals
+
+			if (have_state)
+			{
+				const double send_elapsed = sent_time - send.first_sent_time;
+				const double ack_elapsed = time - send.delivered_time;
+				const double interval = send_elapsed > ack_elapsed ? send_elapsed : ack_elapsed;
+				first_sent_time = sent_time;
+				if (interval > 0.0)
+					bandwidthFilter.Update((float)((delivered - send.delivered) / interval), (double)round_count);
+			}
+
+			const float rtt_sample = (float)(time - sent_time);
+			const bool min_rtt_expired = time - min_rtt_stamp > MinRttWindow;
+			if (min_rtt < 0.0f || rtt_sample <= min_rtt || min_rtt_expired)
+			{
+				min_rtt = rtt_sample;
+				min_rtt_stamp = time;
+			}
+
+			UpdateState(time, round_start, min_rtt_expired, bytes_in_flight);
+		}
+
+		void OnPacketLost(double time, unsigned int sequence, double sent_time, int size, int bytes_in_flight)
+		{
+			SendState& send = sendStates[sequence & (sendStates.size() - 1)];
+			if (send.sequence == sequence)
+				send.valid = false;
+		}
+
+		int GetCongestionWindow() const
+		{
+			if (state == ProbeRtt)
+				return 4 * MaxDatagramSize;
+			if (bandwidthFilter.IsEmpty() || min_rtt < 0.0f)
+				return InitialCongestionWindow * MaxDatagramSize;
+			const int window = (int)(cwnd_gain * GetBandwidthDelayProduct()) + 3 * MaxDatagramSize;
+			return window > 4 * MaxDatagramSize ? window : 4 * MaxDatagramSize;
+		}
+
+		float GetPacingRate(const RttEstimator& rtt) const
+		{
+			if (bandwidthFilter.IsEmpty())
+			{
+				return pacing_gain * InitialCongestionWindow * MaxDatagramSize / rtt.GetPacingRtt();
+			}
+			return pacing_gain * bandwidthFilter.Get();
+		}
+
+		float GetBandwidth() const
+		{
+			return bandwidthFilter.Get();
+		}
+
+		float GetMinRtt() const
+		{
+			return min_rtt;
+		}
+
+	private:
+
+		enum State
+		{
+			Startup,
+			Drain,
+			ProbeBandwidth,
+			ProbeRtt
+		};
+
+		static const int GainCycleLength = 8;
+
+		static float GetCycleGain(int index)
+		{
+			return index == 0 ? 1.25f : (index == 1 ? 0.75f : 1.0f);
+		}
+
+		float GetBandwidthDelayProduct() const
+		{
+			return bandwidthFilter.Get() * (min_rtt > 0.0f ? min_rtt : 0.001f);
+		}
+
+		void EnterProbeBandwidth(double time)
+		{
+			state = ProbeBandwidth;
+			pacing_gain = 1.0f;
+			cwnd_gain = 2.0f;
+			cycle_index = 2;
+			cycle_stamp = time;
+		}
+
+		void UpdateState(double time, bool round_start, bool min_rtt_expired, int bytes_in_flight)
+		{
+			// startup ends once bandwidth stops growing by 25% for three rounds
+
+			if (!filled_pipe && round_start)
+			{
+				if (bandwidthFilter.Get() >= full_bandwidth * 1.25f)
+				{
+					full_bandwidth = bandwidthFilter.Get();
+					full_bandwidth_count = 0;
+				}
+				else if (++full_bandwidth_count >= 3)
+				{
+					filled_pipe = true;
+				}
+			}
+
+			if (state == Startup && filled_pipe)
+			{
+				state = Drain;
+				pacing_gain = 1.0f / BbrHighGain;
+				cwnd_gain = BbrHighGain;
+			}
+
+			if (state == Drain && bytes_in_flight <= GetBandwidthDelayProduct())
+				EnterProbeBandwidth(time);
+
+			if (state == ProbeBandwidth && time - cycle_stamp > min_rtt)
+			{
+				cycle_index = (cycle_index + 1) % GainCycleLength;
+				cycle_stamp = time;
+				pacing_gain = GetCycleGain(cycle_index);
+			}
+
+			// drop to a tiny window for a moment whenever min rtt has not been refreshed, so queues drain and it can be
+
+			if (state != ProbeRtt && min_rtt_expired)
+			{
+				state = ProbeRtt;
+				pacing_gain = 1.0f;
+				probe_rtt_done = -1.0;
+			}
+
+			if (state == ProbeRtt)
+			{
+				if (probe_rtt_done < 0.0 && bytes_in_flight <= 4 * MaxDatagramSize)
+					probe_rtt_done = time + 0.2;
+				else if (probe_rtt_done >= 0.0 && time > probe_rtt_done)
+				{
+					min_rtt_stamp = time;
+					if (filled_pipe)
+						EnterProbeBandwidth(time);
+					else
+					{
+						state = Startup;
+						pacing_gain = BbrHighGain;
+						cwnd_gain = BbrHighGain;
+					}
+				}
+			}
+		}
+
+		struct SendState
+		{
+			unsigned int sequence;		// sequence this state belongs to
+			long long delivered;		// bytes delivered when the packet was sent
+			double delivered_time;		// time of the most recent delivery when the packet was sent
+			double first_sent_time;		// send time of the most recently acked packet when the packet was sent
+			bool valid;
+		};
+
+		std::vector<SendState> sendStates;						// per sequence send state, indexed by sequence % window
+		WindowedFilter<std::greater_equal<float> > bandwidthFilter;	// max delivery rate (bytes/s) over the last 10 rounds
+		State state;
+		long long delivered;				// total bytes delivered
+		double delivered_time;				// time of the most recent delivery
+		double first_sent_time;				// send time of the most recently acked packet
+		long long next_round_delivered;		// delivered count that ends the current round
+		unsigned int round_count;			// number of round trips so far
+		float full_bandwidth;				// bandwidth at the last 25% growth in startup
+		int full_bandwidth_count;			// rounds without 25% growth
+		bool filled_pipe;					// startup has found the bottleneck bandwidth
+		float min_rtt;						// minimum rtt seen in the last MinRttWindow seconds (negative until sampled)
+		double min_rtt_stamp;				// time min rtt was last lowered or refreshed
+		double probe_rtt_done;				// time probe rtt ends (negative until the window has drained)
+		int cycle_index;					// position in the probe bandwidth gain cycle
+		double cycle_stamp;					// time the current gain cycle phase started
+		float pacing_gain;					// pacing rate multiplier
+		float cwnd_gain;					// congestion window multiplier
+	};
+
+	// congestion policy that forwards to an optional congestion control chosen at runtime (not owned)
+	//  + the reliability system holds its congestion policy by value, so a concrete class such as CubicCongestionControl
+	//    used as the policy is called directly, while this one keeps the choice open at the cost of indirect calls
+
+	class DynamicCongestion
+	{
+	public:
+
+		DynamicCongestion()
+		{
+			congestionControl = NULL;
+		}
+
+		void Set(CongestionControl* congestionControl)
+		{
+			this->congestionControl = congestionControl;
+			if (congestionControl)
+				congestionControl->Reset();
+		}
+
+		CongestionControl* Get() const
+		{
+			return congestionControl;
+		}
+
+		void Reset()
+		{
+			if (congestionControl)
+				congestionControl->Reset();
+		}
+
+		void OnPacketSent(double time, unsigned int sequence, int size, int bytes_in_flight)
+		{
+			if (congestionControl)
+				congestionControl->OnPacketSent(time, sequence, size, bytes_in_flight);
+		}
+
+		void OnPacketAcked(double time, unsigned int sequence, double sent_time, int size, int bytes_in_flight, const RttEstimator& rtt)
+		{
+			if (congestionControl)
+				congestionControl->OnPacketAcked(time, sequence, sent_time, size, bytes_in_flight, rtt);
+		}
+
+		void OnPacketLost(double time, unsigned int sequence, double sent_time, int size, int bytes_in_flight)
+		{
+			if (congestionControl)
+				congestionControl->OnPacketLost(time, sequence, sent_time, size, bytes_in_flight);
+		}
+
+		// no window and no pacing without congestion control
+
+		int GetCongestionWindow() const
+		{
+			return congestionControl ? congestionControl->GetCongestionWindow() : INT_MAX;
+		}
+
+		float GetPacingRate(const RttEstimator& rtt) const
+		{
+			return congestionControl ? congestionControl->GetPacingRate(rtt) : 0.0f;
+		}
+
+	private:
+
+		CongestionControl* congestionControl;
+	};
+
+	// reliability system to support reliable connection
+	//  + manages sent, received, pending ack and acked packet queues
+	//  + separated out from reliable connection because it is quite complex and i want to unit test it!
+	//  + AckWidth is the number of acks carried by each header, CongestionPolicy is fed with send, ack and loss events
+
+	template <int AckWidth, class CongestionPolicy> class BasicReliabilitySystem
+	{
+	public:
+
+		typedef AckBitmap<AckWidth> AckBits;
+
+		BasicReliabilitySystem(unsigned int max_sequence = 0xFFFFFFFF, unsigned int window_size = DefaultPacketQueueCapacity)
+		{
+			this->max_sequence = max_sequence;
+			if (max_sequence != 0xFFFFFFFF && max_sequence + 1 < window_size)
+				window_size = max_sequence + 1;
+			sentQueue.init(window_size, max_sequence);
+			pendingAckQueue.init(window_size, max_sequence);
+			ackedQueue.init(window_size, max_sequence);
+			maturedAckQueue.init(window_size, max_sequence);
+			loss_gap = 3;
+			ack_frequency = DefaultAckFrequency;
+			ack_delay = DefaultAckDelay;
+			Reset();
+		}
+
+		void Reset()
+		{
+			local_sequence = 0;
+			remote_sequence = 0;
+			sentQueue.clear();
+			receivedBits.clear();
+			received_any = false;
+			unacked_packets = 0;
+			unacked_time = 0.0;
+			ack_immediately = false;
+			pendingAckQueue.clear();
+			ackedQueue.clear();
+			maturedAckQueue.clear();
+			time = 0.0;
+			sent_packets = 0;
+			recv_packets = 0;
+			lost_packets = 0;
+			acked_packets = 0;
+			sent_bandwidth = 0.0f;
+			acked_bandwidth = 0.0f;
+			rtt.Reset();
+			rtt_maximum = 1.0f;
+			congestion.Reset();
+			acks.clear();
+			losses.clear();
+		}
+
+		void PacketSent(int size)
+		{
+			PacketData data;
+			data.sequence = local_sequence;
+			data.time = time;
+			data.size = size;
+			sentQueue.insert_sorted(data);
+			while (pendingAckQueue.size() &&
+				(pendingAckQueue.front().sequence == local_sequence ||
+				 sequence_distance(pendingAckQueue.front().sequence, local_sequence, max_sequence) >= pendingAckQueue.capacity()))
+				PacketLost();
+			assert(!pendingAckQueue.exists(local_sequence));
+			congestion.OnPacketSent(time, local_sequence, size, pendingAckQueue.bytes());
+			pendingAckQueue.insert_sorted(data);
+			sent_packets++;
+			local_sequence++;
+			if (local_sequence > max_sequence)
+				local_sequence = 0;
+		}
+
+		// fold a received sequence into the ack bitmap: newer sequences shift it along, older ones set their bit
+		//  + a gap, a late packet or a duplicate makes the ack due straight away, so the sender learns of it quickly
+
+		void PacketReceived(unsigned int sequence, int size)
+		{
+			recv_packets++;
+			bool gap = false;
+			if (!received_any)
+			{
+				received_any = true;
+				remote_sequence = sequence;
+				receivedBits.clear();
+			}
+			else if (sequence_more_recent(sequence, remote_sequence, max_sequence))
+			{
+				const unsigned int distance = sequence_distance(remote_sequence, sequence, max_sequence);
+				receivedBits.shift(distance);
+				if (distance <= AckBits::Size)
+					receivedBits.set(distance - 1);
+				remote_sequence = sequence;
+				gap = distance > 1;
+			}
+			else
+			{
+				if (sequence != remote_sequence)
+				{
+					const unsigned int distance = sequence_distance(sequence, remote_sequence, max_sequence);
+					if (distance <= AckBits::Size)
+						receivedBits.set(distance - 1);
+				}
+				gap = true;
+			}
+			if (unacked_packets++ == 0)
+				unacked_time = time;
+			ack_immediately = ack_immediately || gap;
+		}
+
+		// the acks went out, on a packet with a payload or on their own
+
+		void AckSent()
+		{
+			unacked_packets = 0;
+			ack_immediately = false;
+		}
+
+		// true once received packets have waited long enough that a standalone ack should go out
+
+		bool IsAckDue() const
+		{
+			return unacked_packets > 0 && ack_frequency > 0 &&
+				(ack_immediately || unacked_packets >= ack_frequency || time - unacked_time >= ack_delay);
+		}
+
+		// seconds until IsAckDue, capped at rtt_maximum like the timeout deadline
+
+		float GetTimeUntilAckDue() const
+		{
+			if (unacked_packets == 0 || ack_frequency <= 0)
+				return rtt_maximum;
+			if (IsAckDue())
+				return 0.0f;
+			return (float)std::max(std::min(unacked_time + ack_delay - time, (double)rtt_maximum), 0.0);
+		}
+
+		const AckBits& GenerateAckBits() const
+		{
+			return receivedBits;
+		}
+
+		// process acks, then declare pending packets lost once an ack arrives loss_gap or more sequences past them
+
+		void ProcessAck(unsigned int ack, const AckBits& ack_bits)
+		{
+			const size_t previous_acks = acks.size();
+			process_ack(ack, ack_bits, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, time, max_sequence);
+			for (size_t i = previous_acks; i < acks.size(); ++i)
+			{
+				const PacketData* data = ackedQueue.find(acks[i]);
+				if (data)
+					congestion.OnPacketAcked(time, data->sequence, data->time, data->size, pendingAckQueue.bytes(), rtt);
+			}
+			if (loss_gap == 0)
+				return;
+			while (pendingAckQueue.size() &&
+				sequence_more_recent(ack, pendingAckQueue.front().sequence, max_sequence) &&
+				sequence_distance(pendingAckQueue.front().sequence, ack, max_sequence) >= loss_gap)
+				PacketLost();
+		}
+
+		void Update(float deltaTime)
+		{
+			acks.clear();
+			losses.clear();
+			time += deltaTime;
+			rtt.SetGranularity(deltaTime);
+			UpdateQueues();
+			UpdateStats();
+#ifdef NET_UNIT_TEST
+			Validate();
+#endif
+		}
+
+		void Validate()
+		{
+			sentQueue.verify_sorted();
+			pendingAckQueue.verify_sorted();
+			ackedQueue.verify_sorted();
+			maturedAckQueue.verify_sorted();
+		}
+
+		// utility functions
+
+	/*
+		static bool sequence_more_recent( unsigned int s1, unsigned int s2, unsigned int max_sequence )
+		{
+			return ( s1 > s2 ) && ( s1 - s2 <= max_sequence/2 ) || ( s2 > s1 ) && ( s2 - s1 > max_sequence/2 );
+		}
+	*/
+
+		static int bit_index_for_sequence(unsigned int sequence, unsigned int ack, unsigned int max_sequence)
+		{
+			assert(sequence != ack);
+			assert(!sequence_more_recent(sequence, ack, max_sequence));
+			if (sequence > ack)
+			{
+				assert(ack < 33);
+				assert(max_sequence >= sequence);
+				return ack + (max_sequence - sequence);
+			}
+			else
+			{
+				assert(ack >= 1);
+				assert(sequence <= ack - 1);
+				return ack - 1 - sequence;
+			}
+		}
+
+		static unsigned int sequence_for_bit_index(int bit_index, unsigned int ack, unsigned int max_sequence)
+		{
+			assert(bit_index >= 0);
+			const unsigned int offset = (unsigned int)bit_index + 1;
+			return ack >= offset ? ack - offset : max_sequence - (offset - ack - 1);
+		}
+
+		static void process_ack(unsigned int ack, const AckBits& ack_bits,
+			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
+			std::vector<unsigned int>& acks, unsigned int& acked_packets,
+			RttEstimator& rtt, double time, unsigned int max_sequence)
+		{
+			if (pending_ack_queue.empty())
+				return;
+
+			// look up each acked sequence directly, oldest first so acks are reported in sequence order
+			//  + empty words are skipped whole, so a sparse bitmap costs one test per word
+
+			for (int word_index = AckBits::Words - 1; word_index >= 0; --word_index)
+			{
+				const unsigned int word = ack_bits.GetWord(word_index);
+				if (word == 0)
+					continue;
+				for (int bit = 31; bit >= 0; --bit)
+				{
+					if (!((word >> bit) & 1))
+						continue;
+					const unsigned int sequence = sequence_for_bit_index(word_index * 32 + bit, ack, max_sequence);
+					if (sequence_more_recent(ack, sequence, max_sequence))
+						ack_sequence(sequence, pending_ack_queue, acked_queue, acks, acked_packets, rtt, time);
+				}
+			}
+
+			ack_sequence(ack, pending_ack_queue, acked_queue, acks, acked_packets, rtt, time);
+		}
+
+		// data accessors
+
+		unsigned int GetLocalSequence() const
+		{
+			return local_sequence;
+		}
+
+		unsigned int GetRemoteSequence() const
+		{
+			return remote_sequence;
+		}
+
+		unsigned int GetMaxSequence() const
+		{
+			return max_sequence;
+		}
+
+		void GetAcks(unsigned int** acks, int& count)
+		{
+			*acks = this->acks.empty() ? NULL : &this->acks[0];
+			count = (int)this->acks.size();
+		}
+
+		void GetLosses(unsigned int** losses, int& count)
+		{
+			*losses = this->losses.empty() ? NULL : &this->losses[0];
+			count = (int)this->losses.size();
+		}
+
+		unsigned int GetWindowSize() const
+		{
+			return pendingAckQueue.capacity();
+		}
+
+		// congestion control is optional and not owned, it is reset along with the reliability system (DynamicCongestion only)
+
+		void SetCongestionControl(CongestionControl* congestionControl)
+		{
+			congestion.Set(congestionControl);
+		}
+
+		CongestionControl* GetCongestionControl() const
+		{
+			return congestion.Get();
+		}
+
+		CongestionPolicy& GetCongestionPolicy()
+		{
+			return congestion;
+		}
+
+		int GetBytesInFlight() const
+		{
+			return pendingAckQueue.bytes();
+		}
+
+		// true if a packet of size bytes fits in the congestion window (always true without congestion control)
+
+		bool CanSend(int size) const
+		{
+			return pendingAckQueue.bytes() + size <= congestion.GetCongestionWindow();
+		}
+
+		// pacing rate in bytes per second, zero without congestion control
+
+		float GetPacingRate() const
+		{
+			return congestion.GetPacingRate(rtt);
+		}
+
+		unsigned int GetLossGap() const
+		{
+			return loss_gap;
+		}
+
+		void SetLossGap(unsigned int gap)
+		{
+			loss_gap = gap;
+		}
+
+		// standalone ack every frequency packets received, or after delay seconds. a frequency of 0 disables them,
+		// so acks only go out on packets with a payload
+
+		int GetAckFrequency() const
+		{
+			return ack_frequency;
+		}
+
+		void SetAckFrequency(int frequency)
+		{
+			ack_frequency = frequency;
+		}
+
+		float GetAckDelay() const
+		{
+			return ack_delay;
+		}
+
+		void SetAckDelay(float delay)
+		{
+			ack_delay = delay;
+		}
+
+		unsigned int GetSentPackets() const
+		{
+			return sent_packets;
+		}
+
+		unsigned int GetReceivedPackets() const
+		{
+			return recv_packets;
+		}
+
+		unsigned int GetLostPackets() const
+		{
+			return lost_packets;
+		}
+
+		unsigned int GetAckedPackets() const
+		{
+			return acked_packets;
+		}
+
+		float GetSentBandwidth() const
+		{
+			return sent_bandwidth;
+		}
+
+		float GetAckedBandwidth() const
+		{
+			return acked_bandwidth;
+		}
+
+		float GetRoundTripTime() const
+		{
+			return rtt.GetSmoothedRtt();
+		}
+
+		float GetRoundTripTimeVariance() const
+		{
+			return rtt.GetRttVariance();
+		}
+
+		float GetMinRoundTripTime() const
+		{
+			return rtt.GetMinRtt();
+		}
+
+		float GetRetransmitTimeout() const
+		{
+			return rtt.GetRto();
+		}
+
+		// seconds until the oldest pending packet reaches its retransmission timeout
+		//  + with nothing in flight the only work left is expiring the stats queues, so this is capped at rtt_maximum
+
+		float GetTimeUntilNextTimeout() const
+		{
+			if (pendingAckQueue.empty())
+				return rtt_maximum;
+			const double deadline = pendingAckQueue.front().time + rtt.GetRto();
+			return (float)std::max(std::min(deadline - time, (double)rtt_maximum), 0.0);
+		}
+
+		RttEstimator& GetRttEstimator()
+		{
+			return rtt;
+		}
+
+	protected:
+
+		static void ack_sequence(unsigned int sequence,
+			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
+			std::vector<unsigned int>& acks, unsigned int& acked_packets, RttEstimator& rtt, double time)
+		{
+			const PacketData* data = pending_ack_queue.find(sequence);
+			if (!data)
+				return;
+			rtt.AddSample((float)(time - data->time), time);
+			acked_queue.insert_sorted(*data);
+			acks.push_back(sequence);
+			acked_packets++;
+			pending_ack_queue.remove(sequence);
+		}
+
+		// all queues are ordered by sequence and therefore by send time, so expiry only ever looks at the front of each queue
+
+		void UpdateQueues()
+		{
+			const float epsilon = 0.001f;
+
+			while (sentQueue.size() && time - sentQueue.front().time > rtt_maximum + epsilon)
+				sentQueue.pop_front();
+
+			while (ackedQueue.size() && time - ackedQueue.front().time >= rtt_maximum)
+			{
+				maturedAckQueue.insert_sorted(ackedQueue.front());
+				ackedQueue.pop_front();
+			}
+
+			while (maturedAckQueue.size() && time - maturedAckQueue.front().time > rtt_maximum * 2 - epsilon)
+				maturedAckQueue.pop_front();
+
+			// pending packets older than the retransmission timeout are lost, and the timeout backs off until the next rtt sample
+
+			bool timed_out = false;
+			while (pendingAckQueue.size() && time - pendingAckQueue.front().time > rtt.GetRto() + epsilon)
+			{
+				PacketLost();
+				timed_out = true;
+			}
+			if (timed_out)
+				rtt.Backoff();
+		}
+
+		void PacketLost()
+		{
+			const PacketData data = pendingAckQueue.front();
+			losses.push_back(data.sequence);
+			pendingAckQueue.pop_front();
+			lost_packets++;
+			congestion.OnPacketLost(time, data.sequence, data.time, data.size, pendingAckQueue.bytes());
+		}
+
+		void UpdateStats()
+		{
+			const float sent_bytes_per_second = sentQueue.bytes() / rtt_maximum;
+			const float acked_bytes_per_second = maturedAckQueue.bytes() / rtt_maximum;
+			sent_bandwidth = sent_bytes_per_second * (8 / 1000.0f);
+			acked_bandwidth = acked_bytes_per_second * (8 / 1000.0f);
+		}
+
+	private:
+
+		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
+		unsigned int local_sequence;		// local sequence number for most recently sent packet
+		unsigned int remote_sequence;		// remote sequence number for most recently received packet
+
+		unsigned int sent_packets;			// total number of packets sent
+		unsigned int recv_packets;			// total number of packets received
+		unsigned int lost_packets;			// total number of packets lost
+		unsigned int acked_packets;			// total number of packets acked
+
+		float sent_bandwidth;				// approximate sent bandwidth over the last second
+		float acked_bandwidth;				// approximate acked bandwidth over the last second
+		RttEstimator rtt;					// round trip time estimator, its rto decides when pending packets are lost
+		float rtt_maximum;					// window for sent and acked bandwidth stats (one second)
+		double time;						// local clock in seconds, advanced by Update. queued packets are stamped with it once
+		bool received_any;					// true once remote_sequence holds a sequence we actually received
+		int unacked_packets;				// packets received since the acks last went out
+		double unacked_time;				// time the oldest of them was received
+		bool ack_immediately;				// one of them was out of order, so the ack is due now
+		int ack_frequency;					// standalone ack once this many packets are unacked (0 = never)
+		float ack_delay;					// standalone ack once the oldest unacked packet has waited this long
+
+		unsigned int loss_gap;				// pending packets this many sequences behind an ack are declared lost (0 = wait for the rto)
+		CongestionPolicy congestion;		// congestion control fed with send, ack and loss events
+
+		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
+		std::vector<unsigned int> losses;	// packets declared lost since the start of the last update. cleared each update!
+		AckBits receivedBits;				// received sequences before remote_sequence, updated as packets arrive
+
+		PacketQueue sentQueue;				// sent packets used to calculate sent bandwidth (kept until rtt_maximum)
+		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (kept until the retransmission timeout)
+		PacketQueue ackedQueue;				// acked packets sent less than rtt_maximum ago (then moved to matured ack queue)
+		PacketQueue maturedAckQueue;		// acked packets sent between rtt_maximum and rtt_maximum * 2 ago, used for acked bandwidth
+	};
+
+	typedef BasicReliabilitySystem<NET_ACK_BITS, DynamicCongestion> ReliabilitySystem;
+
+	// retransmit buffer for reliable packets
+	//  + payloads are held by reference in pooled packet buffers until acked, so a caller's handle is kept without a copy
+	//  + a borrowed payload stays in the caller's memory and is only copied into a pooled buffer once it has to be resent
+	//  + slots are found by the sequence currently carrying them through a ring sized to the reliability window,
+	//    so ack and loss handling never search the pool
+
+	const int DefaultRetransmitCapacity = 256;
+
+	class RetransmitBuffer
+	{
+	public:
+
+		RetransmitBuffer(int capacity = DefaultRetransmitCapacity, unsigned int window_size = DefaultPacketQueueCapacity)
+		{
+			assert(capacity > 0);
+			assert((window_size & (window_size - 1)) == 0);
+			this->capacity = capacity;
+			this->window_size = window_size;
+			Reset();
+		}
+
+		void Reset()
+		{
+			freeSlots.clear();
+			for (int i = (int)slots.size() - 1; i >= 0; --i)
+				freeSlots.push_back(i);
+			for (size_t i = 0; i < slots.size(); ++i)
+			{
+				slots[i].packet.Reset();
+				slots[i].borrowed = NULL;
+			}
+			for (size_t i = 0; i < slotForSequence.size(); ++i)
+				slotForSequence[i] = -1;
+			resendHead = 0;
+			resendCount = 0;
+		}
+
+		bool IsFull() const
+		{
+			return !slots.empty() && freeSlots.empty();
+		}
+
+		int GetCount() const
+		{
+			return (int)(slots.size() - freeSlots.size());
+		}
+
+		int GetCapacity() const
+		{
+			return capacity;
+		}
+
+		// hold a payload in a free slot bound to sequence, returns the slot or -1 if the buffer is full
+
+		int Store(unsigned int id, unsigned int sequence, const PacketHandle& packet)
+		{
+			assert(packet.IsValid());
+			return Store(id, sequence, packet, NULL, 0);
+		}
+
+		// as above for a payload left in the caller's memory, which must stay valid until the slot is released or resent
+
+		int StoreBorrowed(unsigned int id, unsigned int sequence, const unsigned char data[], int size)
+		{
+			assert(data && size > 0);
+			return Store(id, sequence, PacketHandle(), data, size);
+		}
+
+		int Find(unsigned int sequence) const
+		{
+			if (slotForSequence.empty())
+				return -1;
+			const int slot = slotForSequence[sequence & (window_size - 1)];
+			return slot >= 0 && slots[slot].sequence == sequence ? slot : -1;
+		}
+
+		// queue a slot whose packet was lost, its payload goes out again under a new sequence
+
+		void QueueResend(int slot)
+		{
+			if (slots[slot].queued)
+				return;
+			Unbind(slot);
+			PushResend(slot);
+		}
+
+		bool HasResend() const
+		{
+			return resendCount > 0;
+		}
+
+		int GetNextResend() const
+		{
+			assert(resendCount > 0);
+			return resendQueue[resendHead];
+		}
+
+		// the next queued slot was resent with sequence, bind it so the ack for that sequence releases it
+
+		void Resent(unsigned int sequence)
+		{
+			assert(resendCount > 0);
+			const int slot = resendQueue[resendHead];
+			resendHead = (resendHead + 1) % capacity;
+			resendCount--;
+			slots[slot].queued = false;
+			slots[slot].sends++;
+			Bind(slot, sequence);
+		}
+
+		void Release(int slot)
+		{
+			assert(!slots[slot].queued);
+			Unbind(slot);
+			slots[slot].packet.Reset();
+			slots[slot].borrowed = NULL;
+			freeSlots.push_back(slot);
+		}
+
+		unsigned int GetId(int slot) const
+		{
+			return slots[slot].id;
+		}
+
+		const PacketHandle& GetPacket(int slot) const
+		{
+			return slots[slot].packet;
+		}
+
+		const unsigned char* GetData(int slot) const
+		{
+			return slots[slot].borrowed ? slots[slot].borrowed : slots[slot].packet.GetData();
+		}
+
+		int GetSize(int slot) const
+		{
+			return slots[slot].borrowed ? slots[slot].borrowedSize : slots[slot].packet.GetSize();
+		}
+
+		// lowest address of a payload still borrowed from the caller, NULL if none is
+
+		const unsigned char* GetLowestBorrowed() const
+		{
+			const unsigned char* lowest = NULL;
+			for (size_t i = 0; i < slots.size(); ++i)
+			{
+				if (slots[i].borrowed && (!lowest || slots[i].borrowed < lowest))
+					lowest = slots[i].borrowed;
+			}
+			return lowest;
+		}
+
+		int GetSends(int slot) const
+		{
+			return slots[slot].sends;
+		}
+
+	private:
+
+		struct Slot
+		{
+			unsigned int id;			// message id reported back on delivery
+			unsigned int sequence;		// sequence of the most recent send of this payload
+			int sends;					// number of times the payload has been sent
+			bool queued;				// waiting in the resend queue
+			PacketHandle packet;		// payload, empty while the slot is free or the payload is borrowed
+			const unsigned char* borrowed;	// payload still in the caller's memory, NULL once copied into packet
+			int borrowedSize;
+		};
+
+		int Store(unsigned int id, unsigned int sequence, const PacketHandle& packet, const unsigned char borrowed[], int borrowedSize)
+		{
+			if (slots.empty())
+				Allocate();
+			if (freeSlots.empty())
+				return -1;
+			const int slot = freeSlots.back();
+			freeSlots.pop_back();
+			Slot& entry = slots[slot];
+			entry.id = id;
+			entry.sends = 1;
+			entry.queued = false;
+			entry.packet = packet;
+			entry.borrowed = borrowed;
+			entry.borrowedSize = borrowedSize;
+			Bind(slot, sequence);
+			return slot;
+		}
+
+		void Allocate()
+		{
+			slots.resize(capacity);
+			resendQueue.resize(capacity);
+			slotForSequence.assign(window_size, -1);
+			Reset();
+		}
+
+		// a slot is queued at most once, so a ring of capacity entries never overflows
+		//  + a borrowed payload is copied here, the caller may reuse its memory once the first send is lost
+
+		void PushResend(int slot)
+		{
+			assert(resendCount < capacity);
+			Slot& entry = slots[slot];
+			if (entry.borrowed)
+			{
+				entry.packet = PacketHandle::Allocate(entry.borrowed, entry.borrowedSize);
+				entry.borrowed = NULL;
+			}
+			entry.queued = true;
+			resendQueue[(resendHead + resendCount) % capacity] = slot;
+			resendCount++;
+		}
+
+		// a slot still bound to an older sequence in the same ring index has fallen out of the window, so it is resent
+
+		void Bind(int slot, unsigned int sequence)
+		{
+			const unsigned int index = sequence & (window_size - 1);
+			const int displaced = slotForSequence[index];
+			slots[slot].sequence = sequence;
+			slotForSequence[index] = slot;
+			if (displaced >= 0 && displaced != slot && !slots[displaced].queued)
+				PushResend(displaced);
+		}
+
+		void Unbind(int slot)
+		{
+			const unsigned int index = slots[slot].sequence & (window_size - 1);
+			if (slotForSequence[index] == slot)
+				slotForSequence[index] = -1;
+		}
+
+		int capacity;							// number of payload slots
+		unsigned int window_size;				// size of the sequence -> slot ring (power of two)
+		std::vector<Slot> slots;				// slot bookkeeping
+		std::vector<int> freeSlots;				// free slot indices
+		std::vector<int> slotForSequence;		// slot bound to each sequence in the window, -1 if none
+		std::vector<int> resendQueue;			// ring of slots waiting to be resent, oldest loss first
+		int resendHead;							// first queued entry of resendQueue
+		int resendCount;						// queued entries
+	};
+
+	// reliability header layouts for BasicReliableConnection: the header size for an ack width, and how to write and read it
+	//  + StandardHeader is big endian sequence, ack and ack bitmap words
+
+	struct StandardHeader
+	{
+		template <int Bits> static constexpr int GetSize()
+		{
+			return 8 + AckBitmap<Bits>::Bytes;
+		}
+
+		template <int Bits> static void Write(unsigned char header[], unsigned int sequence, unsigned int ack, const AckBitmap<Bits>& ack_bits)
+		{
+			WriteInteger(header, sequence);
+			WriteInteger(header + 4, ack);
+			for (int i = 0; i < AckBitmap<Bits>::Words; ++i)
+				WriteInteger(header + 8 + i * 4, ack_bits.GetWord(i));
+		}
+
+		template <int Bits> static void Read(const unsigned char header[], unsigned int& sequence, unsigned int& ack, AckBitmap<Bits>& ack_bits)
+		{
+			sequence = ReadInteger(header);
+			ack = ReadInteger(header + 4);
+			for (int i = 0; i < AckBitmap<Bits>::Words; ++i)
+				ack_bits.SetWord(i, ReadInteger(header + 8 + i * 4));
+		}
+
+		static void WriteInteger(unsigned char* data, unsigned int value)
+		{
+			data[0] = (unsigned char)(value >> 24);
+			data[1] = (unsigned char)((value >> 16) & 0xFF);
+			data[2] = (unsigned char)((value >> 8) & 0xFF);
+			data[3] = (unsigned char)(value & 0xFF);
+		}
+
+		static unsigned int ReadInteger(const unsigned char* data)
+		{
+			return ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) | ((unsigned int)data[2] << 8) | (unsigned int)data[3];
+		}
+	};
+
+	// compact reliability header, negotiated per connection with BasicReliableConnection::EnableCompactHeaders
+	//  + a flags byte, the sequence in 16 bits, then the ack as its 16 bit distance back from the sequence: one byte while
+	//    both sides send at similar rates, two otherwise
+	//  + the ack bitmap follows with its trailing zero bytes trimmed, inverted first when that is shorter, so a window
+	//    with no losses costs nothing
+	//  + flags: bits 0-5 ack bitmap bytes, bit 6 two byte ack distance, bit 7 bitmap inverted
+	//  + sequences must wrap at 16 bits, so the connection is created with max_sequence CompactMaxSequence
+
+	const unsigned int CompactMaxSequence = 0xFFFF;
+
+	struct CompactHeader
+	{
+		enum
+		{
+			AckBytesMask = 0x3F,
+			WideAck = 0x40,
+			InvertedAcks = 0x80
+		};
+
+		template <int Bits> static constexpr int GetSize()
+		{
+			return 5 + AckBitmap<Bits>::Bytes;
+		}
+
+		// returns the header size. the bitmap lengths are tracked with selects rather than branches
+
+		template <int Bits> static int Write(unsigned char header[], unsigned int sequence, unsigned int ack, const AckBitmap<Bits>& ack_bits)
+		{
+			const unsigned int distance = (sequence - ack) & 0xFFFF;
+			const int wide = distance > 0xFF ? 1 : 0;
+			header[1] = (unsigned char)(sequence >> 8);
+			header[2] = (unsigned char)sequence;
+			header[3] = (unsigned char)(distance >> (wide * 8));
+			header[4] = (unsigned char)distance;
+			const int offset = 4 + wide;
+			const int flags = WriteAckBits(header + offset, ack_bits);
+			header[0] = (unsigned char)(flags | (wide ? WideAck : 0));
+			return offset + (flags & AckBytesMask);
+		}
+
+		// read a header from the size bytes available, returns its size or 0 if it is malformed
+
+		template <int Bits> static int Read(const unsigned char header[], int size, unsigned int& sequence, unsigned int& ack, AckBitmap<Bits>& ack_bits)
+		{
+			if (size < 4)
+				return 0;
+			const int count = header[0] & AckBytesMask;
+			const int wide = (header[0] & WideAck) ? 1 : 0;
+			const int offset = 4 + wide;
+			if (count > AckBitmap<Bits>::Bytes || offset + count > size)
+				return 0;
+			sequence = ((unsigned int)header[1] << 8) | (unsigned int)header[2];
+			const unsigned int distance = wide ? ((unsigned int)header[3] << 8) | (unsigned int)header[4] : (unsigned int)header[3];
+			ack = (sequence - distance) & 0xFFFF;
+			ReadAckBits(header + offset, header[0], ack_bits);
+			return offset + count;
+		}
+
+		// write the ack bitmap trimmed of trailing zero bytes, inverted first if that is shorter
+		//  + returns the byte count ored with InvertedAcks if it was inverted, for the flags byte
+
+		template <int Bits> static int WriteAckBits(unsigned char data[], const AckBitmap<Bits>& ack_bits)
+		{
+			unsigned char bytes[AckBitmap<Bits>::Bytes];
+			int plain = 0;
+			int inverted = 0;
+			for (int i = 0; i < AckBitmap<Bits>::Words; ++i)
+			{
+				const unsigned int word = ack_bits.GetWord(i);
+				for (int j = 0; j < 4; ++j)
+				{
+					const int index = i * 4 + j;
+					bytes[index] = (unsigned char)(word >> (j * 8));
+					plain = bytes[index] != 0x00 ? index + 1 : plain;
+					inverted = bytes[index] != 0xFF ? index + 1 : inverted;
+				}
+			}
+			const bool invert = inverted < plain;
+			const int count = invert ? inverted : plain;
+			const unsigned char mask = invert ? 0xFF : 0x00;
+			for (int i = 0; i < count; ++i)
+				data[i] = bytes[i] ^ mask;
+			return count | (invert ? InvertedAcks : 0);
+		}
+
+		// read a bitmap written by WriteAckBits, the caller has checked the byte count in flags is available
+
+		template <int Bits> static void ReadAckBits(const unsigned char data[], int flags, AckBitmap<Bits>& ack_bits)
+		{
+			const int count = flags & AckBytesMask;
+			const unsigned char mask = (flags & InvertedAcks) ? 0xFF : 0x00;
+			for (int i = 0; i < AckBitmap<Bits>::Words; ++i)
+			{
+				unsigned int word = 0;
+				for (int j = 0; j < 4; ++j)
+				{
+					const int index = i * 4 + j;
+					const unsigned char byte = index < count ? data[index] : 0x00;
+					word |= (unsigned int)(unsigned char)(byte ^ mask) << (j * 8);
+				}
+				ack_bits.SetWord(i, word);
+			}
+		}
+	};
+
+	// header of a standalone ack, sent when there is no payload going out to carry the acks
+	//  + the flags byte of CompactHeader, the ack in two bytes (four with WideAck set) and the trimmed ack bitmap
+	//  + it has no sequence of its own, so it is never acked, resent or counted as a sent packet
+
+	struct AckHeader
+	{
+		template <int Bits> static constexpr int GetSize()
+		{
+			return 5 + AckBitmap<Bits>::Bytes;
+		}
+
+		template <int Bits> static int Write(unsigned char header[], unsigned int ack, const AckBitmap<Bits>& ack_bits)
+		{
+			const int wide = ack > 0xFFFF ? 2 : 0;
+			header[1] = (unsigned char)(ack >> 24);
+			header[2] = (unsigned char)(ack >> 16);
+			header[1 + wide] = (unsigned char)(ack >> 8);
+			header[2 + wide] = (unsigned char)ack;
+			const int offset = 3 + wide;
+			const int flags = CompactHeader::WriteAckBits(header + offset, ack_bits);
+			header[0] = (unsigned char)(flags | (wide ? CompactHeader::WideAck : 0));
+			return offset + (flags & CompactHeader::AckBytesMask);
+		}
+
+		// returns the header size, or 0 if it is malformed or longer than size
+
+		template <int Bits> static int Read(const unsigned char header[], int size, unsigned int& ack, AckBitmap<Bits>& ack_bits)
+		{
+			if (size < 3)
+				return 0;
+			const int count = header[0] & CompactHeader::AckBytesMask;
+			const int wide = (header[0] & CompactHeader::WideAck) ? 2 : 0;
+			const int offset = 3 + wide;
+			if (count > AckBitmap<Bits>::Bytes || offset + count > size)
+				return 0;
+			ack = wide ? StandardHeader::ReadInteger(header + 1) : ((unsigned int)header[1] << 8) | (unsigned int)header[2];
+			CompactHeader::ReadAckBits(header + offset, header[0], ack_bits);
+			return offset + count;
+		}
+	};
+
+	// a header shorter than the region it was scattered into leaves the start of the payload in that region: move it to the
+	// front of data, ahead of the rest of the payload. bytes is everything received after the protocol id, data must hold
+	// bytes - headerSize. returns the payload size
+
+	inline int GatherPayload(const unsigned char region[], int regionSize, int headerSize, unsigned char data[], int bytes)
+	{
+		const int inRegion = std::min(bytes, regionSize);
+		const int spilled = inRegion - headerSize;
+		const int tail = bytes - inRegion;
+		if (spilled > 0)
+		{
+			memmove(data + spilled, data, tail);
+			memcpy(data, region + headerSize, spilled);
+		}
+		return bytes - headerSize;
+	}
+
+	// connection with reliability (seq/ack)
+	//  + compile time policies: HeaderPolicy lays out the reliability header, AckWidth is the number of acks each header
+	//    carries, CongestionPolicy is held by value in the reliability system and SocketBackend carries the datagrams
+	//  + with a concrete congestion policy the per packet path has no indirect calls left to block inlining, and the header
+	//    size is a compile time constant. the On* hooks stay virtual for subclasses
+	//  + ReliableConnection is the original configuration: standard header, NET_ACK_BITS acks, congestion control set at runtime
+	//  + the two low bits of the protocol id carry the header format, so the compact header can be negotiated per connection
+
+	template <class HeaderPolicy, int AckWidth, class CongestionPolicy, class SocketBackend>
+	class BasicReliableConnection : public BasicConnection<SocketBackend>
+	{
+	public:
+
+		typedef BasicConnection<SocketBackend> Connection;
+		typedef BasicReliabilitySystem<AckWidth, CongestionPolicy> ReliabilitySystem;
+		typedef typename ReliabilitySystem::AckBits AckBits;
+
+		enum { ReliabilityHeaderSize = HeaderPolicy::template GetSize<AckWidth>() };
+
+		static_assert(AckHeader::template GetSize<AckWidth>() <= ReliabilityHeaderSize, "standalone acks must fit in the header region");
+
+		enum HeaderFormat
+		{
+			StandardFormat = 0,				// HeaderPolicy header
+			OfferFormat = 1,				// HeaderPolicy header, and the sender reads compact headers
+			CompactFormat = 2,				// CompactHeader
+			AckFormat = 3,					// AckHeader and no payload
+			FormatMask = 3
+		};
+
+		BasicReliableConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF)
+			: Connection(protocolId, timeout), reliabilitySystem(max_sequence),
+			  retransmitBuffer(DefaultRetransmitCapacity, reliabilitySystem.GetWindowSize())
+		{
+			message_id = 0;
+			retransmitted_packets = 0;
+			ack_packets = 0;
+			compactHeaders = false;
+			this->SetFormatMask(FormatMask);
+			ClearData();
+#ifdef NET_UNIT_TEST
+			packet_loss_mask = 0;
+#endif
+		}
+
+		~BasicReliableConnection()
+		{
+			if (this->IsRunning())
+				this->Stop();
+		}
+
+		// overriden functions from "Connection"
+		//  + sizes passed to the reliability system are whole datagram sizes so bandwidth stats reflect bytes on the wire
+
+		bool SendPacket(const unsigned char data[], int size, int count)
+		{
+#ifdef NET_UNIT_TEST
+			if (reliabilitySystem.GetLocalSequence() & packet_loss_mask)
+			{
+				reliabilitySystem.PacketSent(size + GetHeaderSize());
+				reliabilitySystem.AckSent();
+				return true;
+			}
+#endif
+			count++;
+
+			if (size > GetMaxPayloadSize())
+				return false;
+			unsigned char header[ReliabilityHeaderSize];
+			unsigned int format = StandardFormat;
+			const int header_size = EncodeHeader(header, format);
+			if (!Connection::SendPacket(header, header_size, data, size, format))
+				return false;
+			reliabilitySystem.PacketSent(size + Connection::GetHeaderSize() + header_size);
+			reliabilitySystem.AckSent();
+			return true;
+		}
+
+		// send the acks on their own, without a payload or a sequence. Update and the receive functions do this when
+		// the reliability system says an ack is due, returns true if one was sent
+
+		bool SendAck()
+		{
+			if (!this->IsConnected() || reliabilitySystem.GetReceivedPackets() == 0)
+				return false;
+			unsigned char header[ReliabilityHeaderSize];
+			const int header_size = AckHeader::Write(header, reliabilitySystem.GetRemoteSequence(), reliabilitySystem.GenerateAckBits());
+			if (!Connection::SendPacket(header, header_size, NULL, 0, AckFormat))
+				return false;
+			reliabilitySystem.AckSent();
+			ack_packets++;
+			return true;
+		}
+
+		// reliable send: the payload is kept and resent under a new sequence each time it is lost, until acked
+		//  + returns a non-zero id passed to OnPacketDelivered once acked, or 0 if it could not be sent or buffered
+
+		unsigned int SendReliablePacket(const unsigned char data[], int size)
+		{
+			if (size > GetMaxPayloadSize() || retransmitBuffer.IsFull())
+				return 0;
+			return SendReliablePacket(PacketHandle::Allocate(data, size));
+		}
+
+		// as above, keeping a reference to the pooled payload instead of copying it
+
+		unsigned int SendReliablePacket(const PacketHandle& packet)
+		{
+			if (packet.GetSize() > GetMaxPayloadSize() || retransmitBuffer.IsFull())
+				return 0;
+			const unsigned int sequence = reliabilitySystem.GetLocalSequence();
+			if (!SendPacket(packet.GetData(), packet.GetSize(), 0))
+				return 0;
+			if (++message_id == 0)
+				++message_id;
+			retransmitBuffer.Store(message_id, sequence, packet);
+			return message_id;
+		}
+
+		// as above for a payload the caller keeps in place until it is acked, e.g. in a mapped file. it is sent straight
+		// from data and only copied if its packet is lost, so data must stay valid while GetLowestBorrowed can reach it
+
+		unsigned int SendBorrowedPacket(const unsigned char data[], int size)
+		{
+			if (size <= 0 || size > GetMaxPayloadSize() || retransmitBuffer.IsFull())
+				return 0;
+			const unsigned int sequence = reliabilitySystem.GetLocalSequence();
+			if (!SendPacket(data, size, 0))
+				return 0;
+			if (++message_id == 0)
+				++message_id;
+			retransmitBuffer.StoreBorrowed(message_id, sequence, data, size);
+			return message_id;
+		}
+
+		// lowest address of a payload sent with SendBorrowedPacket that is neither acked nor copied yet, NULL if none
+
+		const unsigned char* GetLowestBorrowed() const
+		{
+			return retransmitBuffer.GetLowestBorrowed();
+		}
+
+		// the reliability header is received into its own buffer and parsed in place, the payload lands straight in data
+
+		//  + standalone acks are consumed along the way, so a return of 0 still means there is nothing left to receive
+
+		int ReceivePacket(unsigned char data[], int size, unsigned char feedback[])
+		{
+			unsigned char header[ReliabilityHeaderSize];
+			int received_bytes = 0;
+			int payload = 0;
+			do
+			{
+				received_bytes = Connection::ReceivePacket(header, ReliabilityHeaderSize, data, size);
+				payload = ReceivePayload(this->GetPacketFormat(), header, data, size, received_bytes);
+			}
+			while (received_bytes > 0 && payload == 0);
+			FlushAck();
+			if (payload <= 0)
+				return false;
+			printf("%s", feedback);
+			return payload;
+		}
+
+		// receive the payload straight into a pooled buffer the caller can hold on to, returns its size or 0
+
+		int ReceivePacket(PacketHandle& packet)
+		{
+			packet.MakeUnique();
+			unsigned char header[ReliabilityHeaderSize];
+			int received_bytes = 0;
+			int payload = 0;
+			do
+			{
+				received_bytes = Connection::ReceivePacket(header, ReliabilityHeaderSize, packet.GetData(), packet.GetCapacity());
+				payload = ReceivePayload(this->GetPacketFormat(), header, packet.GetData(), packet.GetCapacity(), received_bytes);
+			}
+			while (received_bytes > 0 && payload == 0);
+			FlushAck();
+			packet.SetSize(payload > 0 ? payload : 0);
+			return packet.GetSize();
+		}
+
+		// handle a datagram received by someone else on our behalf, e.g. a ConnectionManager
+		//  + header points at the protocol id, followed by ReliabilityHeaderSize bytes scattered aside (or the rest of the
+		//    datagram if it was shorter), the rest of the datagram is in data, which holds size bytes
+		//  + returns the payload size, gathered into data, 0 for a standalone ack or -1 if the packet is not for us
+
+		int ProcessPacket(const Address& sender, const unsigned char header[], unsigned char data[], int size, int bytes)
+		{
+			if (bytes <= Connection::GetHeaderSize())
+				return -1;
+			if (!Connection::ProcessPacket(sender, header, bytes))
+				return -1;
+			const int payload = ReceivePayload(this->GetPacketFormat(), header + Connection::GetHeaderSize(), data, size, bytes - Connection::GetHeaderSize());
+			FlushAck();
+			return payload;
+		}
+
+		int ReceivePackets(Datagram packets[], int count, int size, int* datagrams = NULL)
+		{
+			const int received = Connection::ReceivePackets(packets, count, size, ReliabilityHeaderSize, 0, datagrams);
+			int accepted = 0;
+			for (int i = 0; i < received; ++i)
+			{
+				const int payload = ReceivePayload(this->GetBatchFormat(i), this->GetBatchHeader(i), packets[i].data, size,
+					packets[i].size + ReliabilityHeaderSize);
+				if (payload <= 0)
+					continue;
+				if (accepted != i)
+				{
+					std::swap(packets[accepted].data, packets[i].data);
+					packets[accepted].address = packets[i].address;
+				}
+				packets[accepted].size = payload;
+				accepted++;
+			}
+			FlushAck();
+			return accepted;
+		}
+
+		// offer the compact header, both sides switch to it once each has seen the other's offer
+		//  + needs 16 bit sequences, so construct with max_sequence CompactMaxSequence. returns false if it cannot be used
+
+		bool EnableCompactHeaders()
+		{
+			if (reliabilitySystem.GetMaxSequence() != CompactMaxSequence ||
+				AckBits::Bytes > CompactHeader::AckBytesMask ||
+				CompactHeader::template GetSize<AckWidth>() > ReliabilityHeaderSize)
+				return false;
+			compactHeaders = true;
+			return true;
+		}
+
+		bool IsCompact() const
+		{
+			return compactHeaders && peerCompact;
+		}
+
+		void Update(float deltaTime)
+		{
+			Connection::Update(deltaTime);
+			UpdateRetransmits();
+			reliabilitySystem.Update(deltaTime);
+			FlushAck();
+			this->Flush();
+		}
+
+		int GetHeaderSize() const
+		{
+			return Connection::GetHeaderSize() + ReliabilityHeaderSize;
+		}
+
+		int GetMaxPayloadSize() const
+		{
+			return MaxDatagramSize - GetHeaderSize();
+		}
+
+		ReliabilitySystem& GetReliabilitySystem()
+		{
+			return reliabilitySystem;
+		}
+
+		// for the DynamicCongestion policy, other policies are reached through the reliability system
+
+		void SetCongestionControl(CongestionControl* congestionControl)
+		{
+			reliabilitySystem.SetCongestionControl(congestionControl);
+		}
+
+		bool CanSendPacket(int size) const
+		{
+			return reliabilitySystem.CanSend(size + GetHeaderSize());
+		}
+
+		unsigned int GetRetransmittedPackets() const
+		{
+			return retransmitted_packets;
+		}
+
+		int GetPendingReliablePackets() const
+		{
+			return retransmitBuffer.GetCount();
+		}
+
+		// reliable payloads that can be pending at once, SendReliablePacket refuses more
+
+		int GetReliableCapacity() const
+		{
+			return retransmitBuffer.GetCapacity();
+		}
+
+		// resend lost payloads while the congestion window allows, oldest first, the rest stay queued
+		//  + max_bytes caps the datagram bytes sent so a paced caller can spend its pacer tokens on resends first.
+		//    returns the datagram bytes sent
+
+		int SendResends(int max_bytes = INT_MAX)
+		{
+			int sent = 0;
+			resend_failed = false;
+			while (retransmitBuffer.HasResend())
+			{
+				const int slot = retransmitBuffer.GetNextResend();
+				const int size = retransmitBuffer.GetSize(slot);
+				if (!CanSendPacket(size) || size + GetHeaderSize() > max_bytes - sent)
+					break;
+				const unsigned int sequence = reliabilitySystem.GetLocalSequence();
+				if (!SendPacket(retransmitBuffer.GetData(slot), size, 0))
+				{
+					resend_failed = true;
+					break;
+				}
+				retransmitBuffer.Resent(sequence);
+				retransmitted_packets++;
+				sent += size + GetHeaderSize();
+			}
+			return sent;
+		}
+
+		// total number of standalone acks sent
+
+		unsigned int GetAckPackets() const
+		{
+			return ack_packets;
+		}
+
+		// queued resends are due now if the window has room for the next one. if the socket refused the last one,
+		// wait for the next timer instead of retrying on every pass
+
+		float GetTimeUntilNextUpdate() const
+		{
+			float deadline = std::min(Connection::GetTimeUntilNextUpdate(), reliabilitySystem.GetTimeUntilNextTimeout());
+			if (this->IsConnected())
+				deadline = std::min(deadline, reliabilitySystem.GetTimeUntilAckDue());
+			if (retransmitBuffer.HasResend() && !resend_failed && CanSendPacket(retransmitBuffer.GetSize(retransmitBuffer.GetNextResend())))
+				return 0.0f;
+			return deadline;
+		}
+
+		// unit test controls
+
+#ifdef NET_UNIT_TEST
+		void SetPacketLossMask(unsigned int mask)
+		{
+			packet_loss_mask = mask;
+		}
+#endif
+
+	protected:
+
+		void WriteInteger(unsigned char* data, unsigned int value)
+		{
+			data[0] = (unsigned char)(value >> 24);
+			data[1] = (unsigned char)((value >> 16) & 0xFF);
+			data[2] = (unsigned char)((value >> 8) & 0xFF);
+			data[3] = (unsigned char)(value & 0xFF);
+		}
+
+		void WriteHeader(unsigned char* header, unsigned int sequence, unsigned int ack, const AckBits& ack_bits)
+		{
+			HeaderPolicy::Write(header, sequence, ack, ack_bits);
+		}
+
+		void ReadInteger(const unsigned char* data, unsigned int& value)
+		{
+			value = (((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
+				((unsigned int)data[2] << 8) | ((unsigned int)data[3]));
+		}
+
+		void ReadHeader(const unsigned char* header, unsigned int& sequence, unsigned int& ack, AckBits& ack_bits)
+		{
+			HeaderPolicy::Read(header, sequence, ack, ack_bits);
+		}
+
+		// called once the packet carrying a reliable payload is acked, with the id SendReliablePacket returned
+
+		virtual void OnPacketDelivered(unsigned int id) {}
+
+		// as above, with the payload that was delivered still held, for layers that keep their own state in it
+
+		virtual void OnPayloadDelivered(unsigned int id, const unsigned char data[], int size)
+		{
+			OnPacketDelivered(id);
+		}
+
+		// called when the packet carrying a reliable payload is lost, return false if the payload is no longer needed
+		// (e.g. the peer got it some other way) to drop it instead of resending it
+
+		virtual bool OnPayloadLost(unsigned int id, const unsigned char data[], int size)
+		{
+			return true;
+		}
+
+		// release acked payloads and resend lost ones. runs before the reliability system update clears its ack and loss lists
+
+		void UpdateRetransmits()
+		{
+			unsigned int* sequences = NULL;
+			int count = 0;
+
+			reliabilitySystem.GetAcks(&sequences, count);
+			for (int i = 0; i < count; ++i)
+			{
+				const int slot = retransmitBuffer.Find(sequences[i]);
+				if (slot < 0)
+					continue;
+				OnPayloadDelivered(retransmitBuffer.GetId(slot), retransmitBuffer.GetData(slot), retransmitBuffer.GetSize(slot));
+				retransmitBuffer.Release(slot);
+			}
+
+			reliabilitySystem.GetLosses(&sequences, count);
+			for (int i = 0; i < count; ++i)
+			{
+				const int slot = retransmitBuffer.Find(sequences[i]);
+				if (slot < 0)
+					continue;
+				if (OnPayloadLost(retransmitBuffer.GetId(slot), retransmitBuffer.GetData(slot), retransmitBuffer.GetSize(slot)))
+					retransmitBuffer.QueueResend(slot);
+				else
+					retransmitBuffer.Release(slot);
+			}
+
+			SendResends();
+		}
+
+		virtual void OnStop()
+		{
+			ClearData();
+		}
+
+		virtual void OnDisconnect()
+		{
+			ClearData();
+		}
+
+	private:
+
+		// write the reliability header in the format agreed with the peer, returns its size
+
+		int EncodeHeader(unsigned char header[], unsigned int& format)
+		{
+			const unsigned int sequence = reliabilitySystem.GetLocalSequence();
+			const unsigned int ack = reliabilitySystem.GetRemoteSequence();
+			if (IsCompact())
+			{
+				format = CompactFormat;
+				return CompactHeader::Write(header, sequence, ack, reliabilitySystem.GenerateAckBits());
+			}
+			format = compactHeaders ? OfferFormat : StandardFormat;
+			WriteHeader(header, sequence, ack, reliabilitySystem.GenerateAckBits());
+			return ReliabilityHeaderSize;
+		}
+
+		// parse the reliability header scattered into region, feed it to the reliability system and gather the payload into data
+		//  + bytes is everything received after the protocol id. returns the payload size, or -1 if the header is malformed
+		//    or the payload would not fit in size bytes, in which case the packet is dropped whole
+
+		//  + a standalone ack only feeds the acks to the reliability system and returns 0
+
+		int ReceivePayload(unsigned int format, const unsigned char region[], unsigned char data[], int size, int bytes)
+		{
+			if (bytes <= 0)
+				return -1;
+			const int available = std::min(bytes, (int)ReliabilityHeaderSize);
+			unsigned int sequence = 0;
+			unsigned int ack = 0;
+			AckBits ack_bits;
+			if (format == AckFormat)
+			{
+				if (AckHeader::Read(region, available, ack, ack_bits) != bytes)
+					return -1;
+				reliabilitySystem.ProcessAck(ack, ack_bits);
+				return 0;
+			}
+			int header_size = 0;
+			if (format == CompactFormat)
+				header_size = CompactHeader::Read(region, available, sequence, ack, ack_bits);
+			else if (available == ReliabilityHeaderSize)
+			{
+				ReadHeader(region, sequence, ack, ack_bits);
+				header_size = ReliabilityHeaderSize;
+			}
+			if (header_size == 0 || bytes - header_size > size)
+				return -1;
+			if (format != StandardFormat)
+				peerCompact = true;
+			reliabilitySystem.PacketReceived(sequence, bytes + Connection::GetHeaderSize());
+			reliabilitySystem.ProcessAck(ack, ack_bits);
+			return GatherPayload(region, ReliabilityHeaderSize, header_size, data, bytes);
+		}
+
+		void FlushAck()
+		{
+			if (reliabilitySystem.IsAckDue())
+				SendAck();
+		}
+
+		void ClearData()
+		{
+			reliabilitySystem.Reset();
+			retransmitBuffer.Reset();
+			resend_failed = false;
+			peerCompact = false;
+		}
+
+#ifdef NET_UNIT_TEST
+		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
+#endif
+
+		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+		RetransmitBuffer retransmitBuffer;		// payloads sent with SendReliablePacket that are not acked yet
+		unsigned int message_id;				// id of the most recent reliable payload
+		unsigned int retransmitted_packets;		// total number of reliable payloads resent
+		unsigned int ack_packets;				// total number of standalone acks sent
+		bool resend_failed;						// the socket refused the last resend, it waits for the next timer
+		bool compactHeaders;					// we offer and read the compact header
+		bool peerCompact;						// the peer has offered or sent compact headers since we connected
+	};
+
+	typedef BasicReliableConnection<StandardHeader, NET_ACK_BITS, DynamicCongestion, Socket> ReliableConnection;
+
+	// arithmetic in GF(2^8) over the polynomial 0x11D, for the erasure code
+	//  + MultiplyAdd multiplies a whole fragment by a constant through two 16 entry tables, one per nibble, which pshufb
+	//    looks up 32 bytes at a time with AVX2 or 16 with SSSE3. without either (as compiled) a scalar loop uses the same tables
+
+	class GaloisField
+	{
+	public:
+
+		static unsigned char Multiply(unsigned char a, unsigned char b)
+		{
+			if (a == 0 || b == 0)
+				return 0;
+			const Tables& tables = GetTables();
+			return tables.exp[tables.log[a] + tables.log[b]];
+		}
+
+		static unsigned char Divide(unsigned char a, unsigned char b)
+		{
+			assert(b != 0);
+			if (a == 0)
+				return 0;
+			const Tables& tables = GetTables();
+			return tables.exp[tables.log[a] + 255 - tables.log[b]];
+		}
+
+		// dst += src, which is xor
+
+		static void Add(unsigned char dst[], const unsigned char src[], int size)
+		{
+			int i = 0;
+#if defined(__AVX2__)
+			for (; i + 32 <= size; i += 32)
+			{
+				const __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+				const __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+				_mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, v));
+			}
+#endif
+#if defined(__SSE2__)
+			for (; i + 16 <= size; i += 16)
+			{
+				const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+				const __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+				_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, v));
+			}
+#endif
+			for (; i < size; ++i)
+				dst[i] ^= src[i];
+		}
+
+		// dst += c * src
+
+		static void MultiplyAdd(unsigned char dst[], const unsigned char src[], unsigned char c, int size)
+		{
+			if (c == 0)
+				return;
+			if (c == 1)
+			{
+				Add(dst, src, size);
+				return;
+			}
+			unsigned char low[16];
+			unsigned char high[16];
+			for (int i = 0; i < 16; ++i)
+			{
+				low[i] = Multiply(c, (unsigned char)i);
+				high[i] = Multiply(c, (unsigned char)(i << 4));
+			}
+			int i = 0;
+#if defined(__AVX2__)
+			const __m256i low32 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)low));
+			const __m256i high32 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)high));
+			const __m256i mask32 = _mm256_set1_epi8(0x0F);
+			for (; i + 32 <= size; i += 32)
+			{
+				const __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+				const __m256i l = _mm256_shuffle_epi8(low32, _mm256_and_si256(v, mask32));
+				const __m256i h = _mm256_shuffle_epi8(high32, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask32));
+				const __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+				_mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+			}
+#endif
+#if defined(__SSSE3__)
+			const __m128i low16 = _mm_loadu_si128((const __m128i*)low);
+			const __m128i high16 = _mm_loadu_si128((const __m128i*)high);
+			const __m128i mask16 = _mm_set1_epi8(0x0F);
+			for (; i + 16 <= size; i += 16)
+			{
+				const __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+				const __m128i l = _mm_shuffle_epi8(low16, _mm_and_si128(v, mask16));
+				const __m128i h = _mm_shuffle_epi8(high16, _mm_and_si128(_mm_srli_epi64(v, 4), mask16));
+				const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+				_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+			}
+#endif
+			for (; i < size; ++i)
+				dst[i] ^= low[src[i] & 0x0F] ^ high[src[i] >> 4];
+		}
+
+	private:
+
+		struct Tables
+		{
+			Tables()
+			{
+				unsigned int x = 1;
+				for (int i = 0; i < 255; ++i)
+				{
+					exp[i] = exp[i + 255] = (unsigned char)x;
+					log[x] = (unsigned char)i;
+					x <<= 1;
+					if (x & 0x100)
+						x ^= 0x11D;
+				}
+				exp[510] = exp[511] = 0;
+				log[0] = 0;
+			}
+
+			unsigned char exp[512];			// doubled so a sum of two logs needs no modulo
+			unsigned char log[256];
+		};
+
+		static const Tables& GetTables()
+		{
+			static const Tables tables;
+			return tables;
+		}
+	};
+
+	// systematic erasure code for groups of up to MaxGroupSize fragments with up to MaxParity parity fragments
+	//  + parity row j of a group is the sum over fragments i of GetCoefficient(j, i) * fragment i, with shorter fragments
+	//    padded with zeros
+	//  + the coefficients are a cauchy matrix with each column scaled so that row 0 is all ones. the first parity fragment
+	//    is then a plain xor that repairs any single loss, and any k of the k + m fragments still rebuild the group, as
+	//    scaling columns keeps every square submatrix of a cauchy matrix invertible
+
+	class ErasureCode
+	{
+	public:
+
+		enum
+		{
+			MaxGroupSize = 64,
+			MaxParity = 16
+		};
+
+		static unsigned char GetCoefficient(int row, int index)
+		{
+			assert(row >= 0 && row < MaxParity);
+			assert(index >= 0 && index < MaxGroupSize);
+			return GaloisField::Divide((unsigned char)(MaxGroupSize ^ index), (unsigned char)((MaxGroupSize + row) ^ index));
+		}
+
+		// write parity row over count fragments to the first size bytes of parity
+
+		static void Encode(int row, const unsigned char* const fragments[], const int sizes[], int count, unsigned char parity[], int size)
+		{
+			memset(parity, 0, size);
+			for (int i = 0; i < count; ++i)
+				GaloisField::MultiplyAdd(parity, fragments[i], GetCoefficient(row, i), sizes[i]);
+		}
+
+		// rebuild the missing fragments of a group in place
+		//  + fragments[i] holds sizes[i] bytes and present[i] is false for the ones to rebuild
+		//  + rows[r] and parity[r] are the parity fragments received, each size bytes, and scratch is reused between calls
+		//  + returns false if there are fewer parity fragments than missing ones
+
+		static bool Decode(unsigned char* const fragments[], const int sizes[], const bool present[], int count,
+			const int rows[], const unsigned char* const parity[], int parityCount, int size, std::vector<unsigned char>& scratch)
+		{
+			int missing[MaxParity];
+			int lost = 0;
+			for (int i = 0; i < count; ++i)
+			{
+				if (present[i])
+					continue;
+				if (lost == parityCount || lost == MaxParity)
+					return false;
+				missing[lost++] = i;
+			}
+			if (lost == 0)
+				return true;
+
+			// syndromes: each parity fragment minus the contribution of the fragments we have
+
+			if ((int)scratch.size() < lost * size)
+				scratch.resize(lost * size);
+			for (int r = 0; r < lost; ++r)
+			{
+				unsigned char* syndrome = &scratch[r * size];
+				memcpy(syndrome, parity[r], size);
+				for (int i = 0; i < count; ++i)
+				{
+					if (present[i])
+						GaloisField::MultiplyAdd(syndrome, fragments[i], GetCoefficient(rows[r], i), sizes[i]);
+				}
+			}
+
+			// invert the coefficients of the missing fragments by gauss-jordan elimination
+
+			unsigned char matrix[MaxParity][MaxParity];
+			unsigned char inverse[MaxParity][MaxParity];
+			for (int r = 0; r < lost; ++r)
+			{
+				for (int c = 0; c < lost; ++c)
+				{
+					matrix[r][c] = GetCoefficient(rows[r], missing[c]);
+					inverse[r][c] = r == c ? 1 : 0;
+				}
+			}
+			for (int c = 0; c < lost; ++c)
+			{
+				int pivot = c;
+				while (pivot < lost && matrix[pivot][c] == 0)
+					pivot++;
+				if (pivot == lost)
+					return false;
+				for (int k = 0; k < lost; ++k)
+				{
+					std::swap(matrix[c][k], matrix[pivot][k]);
+					std::swap(inverse[c][k], inverse[pivot][k]);
+				}
+				const unsigned char scale = GaloisField::Divide(1, matrix[c][c]);
+				for (int k = 0; k < lost; ++k)
+				{
+					matrix[c][k] = GaloisField::Multiply(matrix[c][k], scale);
+					inverse[c][k] = GaloisField::Multiply(inverse[c][k], scale);
+				}
+				for (int r = 0; r < lost; ++r)
+				{
+					const unsigned char factor = matrix[r][c];
+					if (r == c || factor == 0)
+						continue;
+					for (int k = 0; k < lost; ++k)
+					{
+						matrix[r][k] ^= GaloisField::Multiply(factor, matrix[c][k]);
+						inverse[r][k] ^= GaloisField::Multiply(factor, inverse[c][k]);
+					}
+				}
+			}
+
+			for (int c = 0; c < lost; ++c)
+			{
+				unsigned char* fragment = fragments[missing[c]];
+				memset(fragment, 0, sizes[missing[c]]);
+				for (int r = 0; r < lost; ++r)
+					GaloisField::MultiplyAdd(fragment, &scratch[r * size], inverse[c][r], sizes[missing[c]]);
+			}
+			return true;
+		}
+	};
+
+	// message connection: reliable messages larger than a datagram, split into fragments and reassembled in order
+	//  + every payload carries a fragment header: message id, fragment index, fragment size, message size, fec group
+	//    size and kind, so a fragment lands at index * fragment size in the receiver's buffer whatever order it arrives in
+	//  + fragments are sent as reliable packets, so only the ones that are lost are resent. the sender keeps one copy of
+	//    each message and builds fragments in pooled buffers, the receiver reassembles straight into one buffer per
+	//    message. both keep their buffers, so after warming up there is no allocation per message or per fragment
+	//  + with EnableFec each group of fragments is followed by parity fragments (see ErasureCode), sent once and never
+	//    resent. the receiver rebuilds lost fragments from them without waiting a round trip, and tells the sender when
+	//    a message is complete so fragments it no longer needs are dropped instead of resent
+	//  + the number of parity fragments per group follows the loss rate measured by the reliability system
+	//  + at most MessageWindow messages are in flight. the receiver only drains the socket while the next message is
+	//    incomplete, so the sender can never get a window ahead of it
+	//  + every payload is a fragment: use SendMessage and ReceiveMessage on both ends instead of the packet functions
+
+	const int MessageWindow = 8;
+	const int MessageBatchSize = 32;
+	const int MaxMessageSize = 16 * 1024 * 1024;
+	const int FragmentHeaderSize = 12;
+	const int DefaultFecGroupSize = 16;
+	const int DefaultFecMaxParity = 4;
+	const float FecRedundancy = 2.0f;			// parity fragments per fragment expected lost, so most groups survive a bad patch
+	const float FecLossGain = 0.125f;			// weight of each new loss sample in the loss estimate
+	const int FecLossSamplePackets = 32;		// packets sent between loss samples
+
+	class MessageConnection : public ReliableConnection
+	{
+	public:
+
+		MessageConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF)
+			: ReliableConnection(protocolId, timeout, max_sequence), staging(MessageBatchSize * MaxDatagramSize)
+		{
+			for (int i = 0; i < MessageBatchSize; ++i)
+				batch[i].data = &staging[i * MaxDatagramSize];
+			fecGroupSize = 0;
+			fecMaxParity = 0;
+			fecAdaptive = true;
+			lossEstimate = 0.0f;
+			repairedFragments = 0;
+			ClearMessages();
+		}
+
+		// queue a message of 1 to MaxMessageSize bytes, it is copied. returns false if it is too large or the window is full
+
+		bool SendMessage(const unsigned char data[], int size)
+		{
+			assert(data || size == 0);
+			const int fragment_size = GetFragmentSize();
+			if (size <= 0 || size > MaxMessageSize || (size + fragment_size - 1) / fragment_size > 0xFFFF || !CanSendMessage())
+				return false;
+			OutgoingMessage& message = outgoing[sendId % MessageWindow];
+			message.id = sendId++;
+			message.data.assign(data, data + size);
+			message.fragments = (size + fragment_size - 1) / fragment_size;
+			message.fragmentSize = fragment_size;
+			message.groupSize = fecGroupSize;
+			message.sent = 0;
+			message.acked = 0;
+			message.ackedBits.assign((message.fragments + 31) / 32, 0);
+			message.parityGroup = 0;
+			message.parityRows = 0;
+			message.parityNext = 0;
+			sendCount++;
+			return true;
+		}
+
+		bool CanSendMessage() const
+		{
+			return sendCount < MessageWindow;
+		}
+
+		// messages queued or in flight that are not fully acked yet
+
+		int GetPendingMessages() const
+		{
+			return sendCount;
+		}
+
+		// send up to max_parity parity fragments after every group_size fragments of the messages queued from now on
+		//  + adaptive sends as many as the measured loss calls for, otherwise always max_parity
+
+		void EnableFec(int group_size = DefaultFecGroupSize, int max_parity = DefaultFecMaxParity, bool adaptive = true)
+		{
+			assert(group_size > 0 && group_size <= ErasureCode::MaxGroupSize);
+			assert(max_parity > 0 && max_parity <= ErasureCode::MaxParity);
+			fecGroupSize = group_size;
+			fecMaxParity = max_parity;
+			fecAdaptive = adaptive;
+		}
+
+		void DisableFec()
+		{
+			fecGroupSize = 0;
+		}
+
+		// fraction of packets lost recently, as used to size the parity
+
+		float GetLossEstimate() const
+		{
+			return lossEstimate;
+		}
+
+		// fragments rebuilt from parity instead of waiting for them to be resent
+
+		unsigned int GetRepairedFragments() const
+		{
+			return repairedFragments;
+		}
+
+		// next complete message, in the order they were sent. returns its size, or 0 if none is complete yet
+		//  + data points into the reassembly buffer and stays valid until the next call
+		//  + reads the socket until the next message completes or the socket is empty, acking as it goes
+
+		int ReceiveMessage(const unsigned char*& data)
+		{
+			if (delivered)
+			{
+				incoming[receiveId % MessageWindow].fragments = 0;
+				receiveId++;
+				delivered = false;
+			}
+			while (true)
+			{
+				IncomingMessage& message = incoming[receiveId % MessageWindow];
+				if (message.fragments > 0 && message.received == message.fragments)
+				{
+					data = &message.data[0];
+					delivered = true;
+					return message.size;
+				}
+				int datagrams = 0;
+				const int received = ReceivePackets(batch, MessageBatchSize, MaxDatagramSize, &datagrams);
+				if (datagrams == 0)
+					return 0;
+				for (int i = 0; i < received; ++i)
+					ProcessFragment(batch[i].data, batch[i].size);
+			}
+		}
+
+		void Update(float deltaTime)
+		{
+			SendFragments();
+			ReliableConnection::Update(deltaTime);
+			UpdateLossEstimate();
+		}
+
+		float GetTimeUntilNextUpdate() const
+		{
+			if (HasFragmentsToSend() && CanSendPacket(0))
+				return 0.0f;
+			return ReliableConnection::GetTimeUntilNextUpdate();
+		}
+
+	protected:
+
+		// a fragment was acked: mark it in its message and retire fully acked messages from the front of the window
+
+		virtual void OnPayloadDelivered(unsigned int id, const unsigned char data[], int size)
+		{
+			ReliableConnection::OnPayloadDelivered(id, data, size);
+			if (size < FragmentHeaderSize || data[11] != DataFragment)
+				return;
+			OutgoingMessage* message = FindOutgoing((unsigned short)ReadShort(data));
+			const int index = ReadShort(data + 2);
+			if (!message || index >= message->fragments)
+				return;
+			unsigned int& word = message->ackedBits[index >> 5];
+			const unsigned int bit = 1u << (index & 31);
+			if (word & bit)
+				return;
+			word |= bit;
+			message->acked++;
+			RetireMessages();
+		}
+
+		// a fragment was lost: only resend it if the receiver has not rebuilt its message from parity already
+
+		virtual bool OnPayloadLost(unsigned int id, const unsigned char data[], int size)
+		{
+			if (size < FragmentHeaderSize || data[11] != DataFragment)
+				return true;
+			const OutgoingMessage* message = FindOutgoing((unsigned short)ReadShort(data));
+			return message && message->acked < message->fragments;
+		}
+
+		// called once every fragment of a message is acked, with its id counting up from 0 in the order messages were sent
+
+		virtual void OnMessageDelivered(unsigned short id) {}
+
+		virtual void OnStop()
+		{
+			ReliableConnection::OnStop();
+			ClearMessages();
+		}
+
+		virtual void OnDisconnect()
+		{
+			ReliableConnection::OnDisconnect();
+			ClearMessages();
+		}
+
+	private:
+
+		enum FragmentKind
+		{
+			DataFragment = 0,						// 1 to MaxParity: parity row + 1, index is the group
+			CompleteNotice = 0xFF					// sent back by the receiver once it has the whole message
+		};
+
+		struct OutgoingMessage
+		{
+			std::vector<unsigned char> data;	// copy of the message, kept until every fragment is acked
+			std::vector<unsigned int> ackedBits;	// one bit per fragment, set once acked
+			unsigned short id;
+			int fragments;
+			int fragmentSize;
+			int groupSize;						// fragments per fec group, 0 without fec
+			int sent;							// fragments sent at least once, in order
+			int acked;
+			int parityGroup;					// group the parity fragments being sent are for
+			int parityRows;						// parity fragments to send for it
+			int parityNext;						// next of them to send
+		};
+
+		struct IncomingMessage
+		{
+			std::vector<unsigned char> data;	// reassembly buffer, fragments are copied to index * fragmentSize
+			std::vector<unsigned int> receivedBits;	// one bit per fragment, set once received or rebuilt
+			std::vector<unsigned short> groupReceived;	// fragments received or rebuilt per fec group
+			std::vector<PacketHandle> parity;	// parity fragments by group * MaxParity + row, until their group is complete
+			int fragments;						// 0 while the slot is free
+			int fragmentSize;
+			int groupSize;
+			int received;
+			int size;
+		};
+
+		int GetFragmentSize() const
+		{
+			return GetMaxPayloadSize() - FragmentHeaderSize;
+		}
+
+		static unsigned int ReadShort(const unsigned char data[])
+		{
+			return ((unsigned int)data[0] << 8) | (unsigned int)data[1];
+		}
+
+		static void WriteShort(unsigned char data[], unsigned int value)
+		{
+			data[0] = (unsigned char)(value >> 8);
+			data[1] = (unsigned char)value;
+		}
+
+		static void WriteHeader(unsigned char header[], unsigned int id, int index, int fragment_size, int size, int group_size, int kind)
+		{
+			WriteShort(header, id);
+			WriteShort(header + 2, index);
+			WriteShort(header + 4, fragment_size);
+			StandardHeader::WriteInteger(header + 6, size);
+			header[10] = (unsigned char)group_size;
+			header[11] = (unsigned char)kind;
+		}
+
+		// size of fragment index of a message, only the last one can be short
+
+		static int GetFragmentBytes(int index, int fragments, int fragment_size, int size)
+		{
+			return index < fragments - 1 ? fragment_size : size - index * fragment_size;
+		}
+
+		// the message with this id if it is still in flight
+
+		OutgoingMessage* FindOutgoing(unsigned short id)
+		{
+			OutgoingMessage& message = outgoing[id % MessageWindow];
+			if (message.id != id || (unsigned short)(sendId - 1 - id) >= sendCount)
+				return NULL;
+			return &message;
+		}
+
+		void RetireMessages()
+		{
+			while (sendCount > 0)
+			{
+				const OutgoingMessage& oldest = outgoing[(unsigned short)(sendId - sendCount) % MessageWindow];
+				if (oldest.acked < oldest.fragments)
+					break;
+				OnMessageDelivered(oldest.id);
+				sendCount--;
+			}
+		}
+
+		// fold the packets lost since the last sample into the loss estimate
+
+		void UpdateLossEstimate()
+		{
+			const unsigned int sent = GetReliabilitySystem().GetSentPackets();
+			const unsigned int lost = GetReliabilitySystem().GetLostPackets();
+			if (sent < lossSent || lost < lossLost)
+			{
+				lossSent = sent;
+				lossLost = lost;
+			}
+			if (sent - lossSent < (unsigned int)FecLossSamplePackets)
+				return;
+			const float sample = std::min((float)(lost - lossLost) / (float)(sent - lossSent), 1.0f);
+			lossEstimate += (sample - lossEstimate) * FecLossGain;
+			lossSent = sent;
+			lossLost = lost;
+		}
+
+		int GetParityCount(const OutgoingMessage& message) const
+		{
+			if (message.groupSize == 0)
+				return 0;
+			if (!fecAdaptive)
+				return fecMaxParity;
+			return std::min(fecMaxParity, (int)(message.groupSize * lossEstimate * FecRedundancy + 0.75f));
+		}
+
+		bool HasFragmentsToSend() const
+		{
+			for (int i = sendCount; i > 0; --i)
+			{
+				const OutgoingMessage& message = outgoing[(unsigned short)(sendId - i) % MessageWindow];
+				if (message.sent < message.fragments || message.parityNext < message.parityRows)
+					return true;
+			}
+			return false;
+		}
+
+		// send the next unsent fragments, oldest message first, while congestion control and the retransmit buffer allow
+		//  + the parity fragments of a group go out as soon as its last fragment has
+
+		void SendFragments()
+		{
+			if (!IsConnected() && !IsConnecting())
+				return;
+			for (int i = sendCount; i > 0; --i)
+			{
+				OutgoingMessage& message = outgoing[(unsigned short)(sendId - i) % MessageWindow];
+				while (true)
+				{
+					if (message.parityNext < message.parityRows)
+					{
+						if (!SendParity(message))
+							return;
+						continue;
+					}
+					if (message.sent == message.fragments)
+						break;
+					const int offset = message.sent * message.fragmentSize;
+					const int bytes = std::min(message.fragmentSize, (int)message.data.size() - offset);
+					if (!CanSendPacket(FragmentHeaderSize + bytes))
+						return;
+					PacketHandle packet = PacketHandle::Allocate();
+					unsigned char* fragment = packet.GetData();
+					WriteHeader(fragment, message.id, message.sent, message.fragmentSize, (int)message.data.size(), message.groupSize, DataFragment);
+					memcpy(fragment + FragmentHeaderSize, &message.data[offset], bytes);
+					packet.SetSize(FragmentHeaderSize + bytes);
+					if (!SendReliablePacket(packet))
+						return;
+					message.sent++;
+					if (message.groupSize > 0 && (message.sent % message.groupSize == 0 || message.sent == message.fragments))
+					{
+						message.parityGroup = (message.sent - 1) / message.groupSize;
+						message.parityRows = GetParityCount(message);
+						message.parityNext = 0;
+					}
+				}
+			}
+		}
+
+		// encode and send the next parity fragment of the group just sent, returns false if it has to wait
+		//  + parity is sent unreliably, if the socket refuses it the rest of the group's parity is skipped
+
+		bool SendParity(OutgoingMessage& message)
+		{
+			const unsigned char* fragments[ErasureCode::MaxGroupSize];
+			int sizes[ErasureCode::MaxGroupSize];
+			const int first = message.parityGroup * message.groupSize;
+			const int count = std::min(message.groupSize, message.fragments - first);
+			for (int i = 0; i < count; ++i)
+			{
+				fragments[i] = &message.data[(first + i) * message.fragmentSize];
+				sizes[i] = GetFragmentBytes(first + i, message.fragments, message.fragmentSize, (int)message.data.size());
+			}
+			if (!CanSendPacket(FragmentHeaderSize + sizes[0]))
+				return false;
+			PacketHandle packet = PacketHandle::Allocate();
+			unsigned char* parity = packet.GetData();
+			WriteHeader(parity, message.id, message.parityGroup, message.fragmentSize, (int)message.data.size(), message.groupSize, message.parityNext + 1);
+			ErasureCode::Encode(message.parityNext, fragments, sizes, count, parity + FragmentHeaderSize, sizes[0]);
+			packet.SetSize(FragmentHeaderSize + sizes[0]);
+			if (!SendPacket(packet.GetData(), packet.GetSize(), 0))
+			{
+				message.parityNext = message.parityRows;
+				return false;
+			}
+			message.parityNext++;
+			return true;
+		}
+
+		// tell the sender we have every fragment of a message, sent again for each fragment of it that still arrives
+
+		void SendCompleteNotice(unsigned short id)
+		{
+			if (!IsConnected())
+				return;
+			unsigned char notice[FragmentHeaderSize];
+			WriteHeader(notice, id, 0, 0, 0, 0, CompleteNotice);
+			SendPacket(notice, FragmentHeaderSize, 0);
+		}
+
+		// the receiver has a whole message: every fragment of it counts as acked, and lost ones are no longer resent
+
+		void ProcessCompleteNotice(unsigned short id)
+		{
+			OutgoingMessage* message = FindOutgoing(id);
+			if (!message || message->sent < message->fragments)
+				return;
+			message->acked = message->fragments;
+			std::fill(message->ackedBits.begin(), message->ackedBits.end(), 0xFFFFFFFFu);
+			message->parityNext = message->parityRows;
+			RetireMessages();
+		}
+
+		// copy a received fragment into its message or keep a parity fragment for repairs, dropping duplicates and
+		// anything malformed. fragments of messages we already have are answered with a complete notice
+
+		void ProcessFragment(const unsigned char data[], int size)
+		{
+			if (size < FragmentHeaderSize)
+				return;
+			const unsigned short message_id = (unsigned short)ReadShort(data);
+			const int index = ReadShort(data + 2);
+			const int fragment_size = ReadShort(data + 4);
+			const unsigned int message_size = StandardHeader::ReadInteger(data + 6);
+			const int group_size = data[10];
+			const int kind = data[11];
+			const int bytes = size - FragmentHeaderSize;
+			if (kind == CompleteNotice)
+			{
+				ProcessCompleteNotice(message_id);
+				return;
+			}
+			if ((unsigned short)(message_id - receiveId) >= MessageWindow)
+			{
+				if ((unsigned short)(receiveId - 1 - message_id) < 0x8000)
+					SendCompleteNotice(message_id);
+				return;
+			}
+			if (fragment_size <= 0 || fragment_size > MaxDatagramSize || message_size == 0 || message_size > (unsigned int)MaxMessageSize ||
+				group_size > ErasureCode::MaxGroupSize || kind > ErasureCode::MaxParity || (kind != DataFragment && group_size == 0))
+				return;
+			const int fragments = (int)((message_size + fragment_size - 1) / fragment_size);
+			if (fragments > 0xFFFF)
+				return;
+			const int groups = group_size > 0 ? (fragments + group_size - 1) / group_size : 0;
+			if (kind == DataFragment ? index >= fragments : index >= groups)
+				return;
+			const int fragment_bytes = GetFragmentBytes(kind == DataFragment ? index : index * group_size, fragments, fragment_size, message_size);
+			if (bytes != fragment_bytes)
+				return;
+
+			IncomingMessage& message = incoming[message_id % MessageWindow];
+			if (message.fragments == 0)
+			{
+				message.fragments = fragments;
+				message.fragmentSize = fragment_size;
+				message.groupSize = group_size;
+				message.received = 0;
+				message.size = (int)message_size;
+				if ((int)message.data.size() < fragments * fragment_size)
+					message.data.resize(fragments * fragment_size);
+				message.receivedBits.assign((fragments + 31) / 32, 0);
+				message.groupReceived.assign(groups, 0);
+				message.parity.resize(std::max((int)message.parity.size(), groups * ErasureCode::MaxParity));
+			}
+			else if (message.fragments != fragments || message.fragmentSize != fragment_size || message.size != (int)message_size ||
+				message.groupSize != group_size)
+				return;
+			if (message.received == message.fragments)
+			{
+				SendCompleteNotice(message_id);
+				return;
+			}
+
+			const int group = group_size > 0 ? (kind == DataFragment ? index / group_size : index) : 0;
+			if (kind == DataFragment)
+			{
+				unsigned int& word = message.receivedBits[index >> 5];
+				const unsigned int bit = 1u << (index & 31);
+				if (word & bit)
+					return;
+				word |= bit;
+				memcpy(&message.data[index * fragment_size], data + FragmentHeaderSize, bytes);
+				message.received++;
+				if (group_size > 0)
+					message.groupReceived[group]++;
+			}
+			else
+			{
+				const int count = std::min(group_size, fragments - group * group_size);
+				PacketHandle& parity = message.parity[group * ErasureCode::MaxParity + kind - 1];
+				if (message.groupReceived[group] == count || parity.IsValid())
+					return;
+				parity = PacketHandle::Allocate(data + FragmentHeaderSize, bytes);
+			}
+			if (group_size > 0)
+				RepairGroup(message, group);
+			if (message.received == message.fragments)
+				SendCompleteNotice(message_id);
+		}
+
+		// rebuild the missing fragments of a group once enough parity has arrived, and let go of its parity once it is whole
+
+		void RepairGroup(IncomingMessage& message, int group)
+		{
+			const int first = group * message.groupSize;
+			const int count = std::min(message.groupSize, message.fragments - first);
+			PacketHandle* parity = &message.parity[group * ErasureCode::MaxParity];
+			if (message.groupReceived[group] < count)
+			{
+				int rows[ErasureCode::MaxParity];
+				const unsigned char* parityData[ErasureCode::MaxParity];
+				int parityCount = 0;
+				for (int row = 0; row < ErasureCode::MaxParity && message.groupReceived[group] + parityCount < count; ++row)
+				{
+					if (!parity[row].IsValid())
+						continue;
+					rows[parityCount] = row;
+					parityData[parityCount++] = parity[row].GetData();
+				}
+				if (message.groupReceived[group] + parityCount < count)
+					return;
+				unsigned char* fragments[ErasureCode::MaxGroupSize];
+				int sizes[ErasureCode::MaxGroupSize];
+				bool present[ErasureCode::MaxGroupSize];
+				for (int i = 0; i < count; ++i)
+				{
+					const int index = first + i;
+					fragments[i] = &message.data[index * message.fragmentSize];
+					sizes[i] = GetFragmentBytes(index, message.fragments, message.fragmentSize, message.size);
+					present[i] = (message.receivedBits[index >> 5] >> (index & 31)) & 1;
+				}
+				if (!ErasureCode::Decode(fragments, sizes, present, count, rows, parityData, parityCount, sizes[0], repairScratch))
+					return;
+				for (int i = 0; i < count; ++i)
+				{
+					if (present[i])
+						continue;
+					message.receivedBits[(first + i) >> 5] |= 1u << ((first + i) & 31);
+					message.received++;
+					repairedFragments++;
+				}
+				message.groupReceived[group] = (unsigned short)count;
+			}
+			for (int row = 0; row < ErasureCode::MaxParity; ++row)
+				parity[row].Reset();
+		}
+
+		void ClearMessages()
+		{
+			sendId = 0;
+			sendCount = 0;
+			receiveId = 0;
+			delivered = false;
+			lossSent = 0;
+			lossLost = 0;
+			for (int i = 0; i < MessageWindow; ++i)
+			{
+				outgoing[i].id = 0;
+				outgoing[i].fragments = 0;
+				incoming[i].fragments = 0;
+				for (size_t j = 0; j < incoming[i].parity.size(); ++j)
+					incoming[i].parity[j].Reset();
+			}
+		}
+
+		OutgoingMessage outgoing[MessageWindow];	// messages in flight, by id modulo the window
+		IncomingMessage incoming[MessageWindow];	// messages being reassembled, by id modulo the window
+		unsigned short sendId;						// id of the next message queued
+		int sendCount;								// messages queued or in flight, ending just before sendId
+		unsigned short receiveId;					// id of the next message to deliver
+		bool delivered;								// ReceiveMessage returned receiveId, free it on the next call
+		std::vector<unsigned char> staging;			// batch receive buffers, fragments are copied on from here
+		Datagram batch[MessageBatchSize];
+		int fecGroupSize;							// fragments per fec group for messages queued from now on, 0 for no fec
+		int fecMaxParity;
+		bool fecAdaptive;
+		float lossEstimate;							// moving average of the fraction of packets lost
+		unsigned int lossSent;						// sent and lost packet counts at the last loss sample
+		unsigned int lossLost;
+		unsigned int repairedFragments;
+		std::vector<unsigned char> repairScratch;	// syndromes for ErasureCode::Decode, kept between repairs
+	};
+
+	// channel connection: independent message streams over one reliable connection
+	//  + each channel has its own 16 bit sequence space and delivery rule, so a loss on one never holds up another
+	//    - ReliableOrdered: resent until acked, delivered in order through a reorder buffer
+	//    - ReliableUnordered: resent until acked, delivered as it arrives with duplicates dropped
+	//    - UnreliableSequenced: sent once, anything older than the newest message delivered is dropped
+	//    - Unreliable: sent once, delivered as it arrives
+	//  + messages wait in per channel queues, Update sends them by deficit round robin: each round a channel may send
+	//    weight * ChannelQuantum bytes, for as long as the congestion window has room. lost reliable messages are resent
+	//    by the reliable connection ahead of the queues
+	//  + reliable channels keep at most ChannelWindow messages unacked, so the receiver's reorder buffer always has room
+	//  + messages are packed into shared datagrams, one for reliable channels and one for the others, each message
+	//    behind a 5 byte header (channel index, sequence, length). a datagram goes out once the next message would not
+	//    fit, once it has waited the aggregation delay (0 by default: at the end of the Update that filled it) or on
+	//    FlushMessages, so chatty traffic costs one datagram and one reliability sequence per tick instead of per message
+	//  + both ends must add the same channels in the same order, and use SendMessage and ReceiveMessage instead of the
+	//    packet functions
+
+	enum ChannelType
+	{
+		ReliableOrdered,
+		ReliableUnordered,
+		UnreliableSequenced,
+		Unreliable
+	};
+
+	const int MaxChannels = 8;
+	const int ChannelHeaderSize = 5;
+	const int ChannelWindow = 1024;
+	const int ChannelQuantum = MaxDatagramSize;
+	const int DefaultChannelQueueCapacity = 256;
+	const float DefaultAggregationDelay = 0.0f;
+
+	class ChannelConnection : public ReliableConnection
+	{
+	public:
+
+		ChannelConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF)
+			: ReliableConnection(protocolId, timeout, max_sequence), ready(MaxDatagramSize / (ChannelHeaderSize + 1) + 1)
+		{
+			channelCount = 0;
+			nextChannel = 0;
+			aggregationDelay = DefaultAggregationDelay;
+			time = 0.0;
+			ClearAggregates();
+		}
+
+		// add a channel, returns its index or -1 if there are MaxChannels already. weight is its share of the congestion
+		// window relative to the other channels
+
+		int AddChannel(ChannelType type, int weight = 1, int queue_capacity = DefaultChannelQueueCapacity)
+		{
+			assert(weight > 0);
+			assert(queue_capacity > 0);
+			if (channelCount == MaxChannels)
+				return -1;
+			Channel& channel = channels[channelCount];
+			channel.type = type;
+			channel.weight = weight;
+			channel.queue.assign(queue_capacity, PacketHandle());
+			const bool reliable = type == ReliableOrdered || type == ReliableUnordered;
+			channel.acked.assign(reliable ? ChannelWindow : 0, 0);
+			channel.received.assign(reliable ? ChannelWindow : 0, 0);
+			channel.reorder.assign(type == ReliableOrdered ? ChannelWindow : 0, PacketHandle());
+			ResetChannel(channel);
+			return channelCount++;
+		}
+
+		int GetChannelCount() const
+		{
+			return channelCount;
+		}
+
+		ChannelType GetChannelType(int channel) const
+		{
+			assert(channel >= 0 && channel < channelCount);
+			return channels[channel].type;
+		}
+
+		void SetChannelWeight(int channel, int weight)
+		{
+			assert(channel >= 0 && channel < channelCount);
+			assert(weight > 0);
+			channels[channel].weight = weight;
+		}
+
+		// messages queued on a channel and not sent yet
+
+		int GetQueuedMessages(int channel) const
+		{
+			assert(channel >= 0 && channel < channelCount);
+			return channels[channel].queueCount;
+		}
+
+		int GetMaxMessageSize() const
+		{
+			return GetMaxPayloadSize() - ChannelHeaderSize;
+		}
+
+		// queue a message of 1 to GetMaxMessageSize bytes, it is copied. returns false if it does not fit or the queue is full
+
+		bool SendMessage(int channel, const unsigned char data[], int size)
+		{
+			assert(channel >= 0 && channel < channelCount);
+			Channel& c = channels[channel];
+			if (size <= 0 || size > GetMaxMessageSize() || c.queueCount == (int)c.queue.size())
+				return false;
+			PacketHandle packet = PacketHandle::Allocate();
+			unsigned char* payload = packet.GetData();
+			payload[0] = (unsigned char)channel;
+			payload[1] = (unsigned char)(c.sendSequence >> 8);
+			payload[2] = (unsigned char)c.sendSequence;
+			payload[3] = (unsigned char)(size >> 8);
+			payload[4] = (unsigned char)size;
+			memcpy(payload + ChannelHeaderSize, data, size);
+			packet.SetSize(ChannelHeaderSize + size);
+			c.queue[(c.queueHead + c.queueCount) % c.queue.size()] = std::move(packet);
+			c.queueCount++;
+			c.sendSequence++;
+			return true;
+		}
+
+		// next message from any channel, returns its size or 0 if there is none. channel is set to the channel it came on
+		//  + messages unpacked from a datagram go first, then those a reorder buffer was holding back, then datagrams are
+		//    read until one has a message to deliver
+		//  + the socket is only read once nothing is waiting, so a reliable sender can never get more than ChannelWindow
+		//    messages ahead of what has been delivered
+
+		int ReceiveMessage(int& channel, PacketHandle& message)
+		{
+			while (true)
+			{
+				if (readyCount > 0)
+				{
+					ReadyMessage& next = ready[readyHead];
+					message = std::move(next.message);
+					channel = next.channel;
+					readyHead = (readyHead + 1) % (int)ready.size();
+					readyCount--;
+					return message.GetSize();
+				}
+				if (DeliverReordered(channel, message))
+					return message.GetSize();
+				PacketHandle packet;
+				const int size = ReceivePacket(packet);
+				if (size <= 0)
+					return 0;
+				Unpack(packet, size);
+			}
+		}
+
+		// send everything queued now, without waiting for Update or the aggregation delay
+
+		void FlushMessages()
+		{
+			SendQueued();
+			SendAggregates(true);
+			this->Flush();
+		}
+
+		// seconds a partly filled datagram may wait for more messages, 0 sends it at the end of the Update that filled it
+
+		float GetAggregationDelay() const
+		{
+			return aggregationDelay;
+		}
+
+		void SetAggregationDelay(float delay)
+		{
+			assert(delay >= 0.0f);
+			aggregationDelay = delay;
+		}
+
+		void Update(float deltaTime)
+		{
+			time += deltaTime;
+			SendQueued();
+			SendAggregates(false);
+			ReliableConnection::Update(deltaTime);
+		}
+
+		// due now if a queued message or an open datagram could go out: the congestion window has room and, for reliable
+		// ones, so does the retransmit buffer. otherwise acks wake us when either frees up
+
+		float GetTimeUntilNextUpdate() const
+		{
+			const bool reliableRoom = GetPendingReliablePackets() < GetReliableCapacity();
+			for (int i = 0; i < channelCount; ++i)
+			{
+				if (CanSendChannel(channels[i]) && CanSendPacket(0) && (channels[i].acked.empty() || reliableRoom))
+					return 0.0f;
+			}
+			float deadline = ReliableConnection::GetTimeUntilNextUpdate();
+			for (int i = 0; i < 2; ++i)
+			{
+				if (aggregates[i].packet.IsValid() && (i == 0 || reliableRoom))
+					deadline = std::min(deadline, (float)std::max(aggregates[i].opened + aggregationDelay - time, 0.0));
+			}
+			return deadline;
+		}
+
+	protected:
+
+		// a datagram of reliable channel messages was acked: slide each channel's send window past everything acked in order
+
+		virtual void OnPayloadDelivered(unsigned int id, const unsigned char data[], int size)
+		{
+			ReliableConnection::OnPayloadDelivered(id, data, size);
+			for (int offset = 0; offset + ChannelHeaderSize < size; offset += ChannelHeaderSize + ReadLength(data + offset))
+			{
+				const unsigned char* header = data + offset;
+				if (header[0] >= channelCount)
+					return;
+				Channel& c = channels[header[0]];
+				const unsigned short sequence = (unsigned short)(((unsigned int)header[1] << 8) | (unsigned int)header[2]);
+				if (c.acked.empty() || (unsigned short)(sequence - c.sendBase) >= (unsigned short)(c.sentSequence - c.sendBase))
+					continue;
+				c.acked[sequence % ChannelWindow] = 1;
+				while (c.sendBase != c.sentSequence && c.acked[c.sendBase % ChannelWindow])
+				{
+					c.acked[c.sendBase % ChannelWindow] = 0;
+					c.sendBase++;
+				}
+			}
+		}
+
+		virtual void OnStop()
+		{
+			ReliableConnection::OnStop();
+			for (int i = 0; i < channelCount; ++i)
+				ResetChannel(channels[i]);
+			ClearAggregates();
+		}
+
+		virtual void OnDisconnect()
+		{
+			ReliableConnection::OnDisconnect();
+			for (int i = 0; i < channelCount; ++i)
+				ResetChannel(channels[i]);
+			ClearAggregates();
+		}
+
+	private:
+
+		struct Channel
+		{
+			ChannelType type;
+			int weight;
+			int deficit;							// bytes this channel may still send in the current round
+			bool turn;								// it is this channel's turn and its quantum has been added
+			std::vector<PacketHandle> queue;		// messages waiting to be sent, with their channel header written
+			int queueHead;
+			int queueCount;
+			unsigned short sendSequence;			// sequence of the next message queued
+			unsigned short sentSequence;			// sequence of the next message to leave the queue
+			unsigned short sendBase;				// oldest unacked message (reliable channels)
+			std::vector<unsigned char> acked;		// acked flags by sequence modulo the window (reliable channels)
+			unsigned short receiveSequence;			// next to deliver (reliable ordered), next unseen (reliable unordered) or newest delivered
+			bool receivedAny;						// a message has been delivered (unreliable sequenced)
+			std::vector<unsigned char> received;	// received flags by sequence modulo the window (reliable channels)
+			std::vector<PacketHandle> reorder;		// messages received ahead of receiveSequence (reliable ordered)
+		};
+
+		struct Aggregate
+		{
+			PacketHandle packet;					// messages packed so far, invalid while there are none
+			double opened;							// time the first of them was packed
+		};
+
+		struct ReadyMessage
+		{
+			PacketHandle message;
+			int channel;
+		};
+
+		static int ReadLength(const unsigned char header[])
+		{
+			return ((int)header[3] << 8) | (int)header[4];
+		}
+
+		void ClearAggregates()
+		{
+			for (int i = 0; i < 2; ++i)
+				aggregates[i].packet.Reset();
+			for (size_t i = 0; i < ready.size(); ++i)
+				ready[i].message.Reset();
+			readyHead = 0;
+			readyCount = 0;
+		}
+
+		// send the datagram being packed, returns false if congestion control or the socket held it back
+		//  + reliable datagrams are kept by the retransmit buffer, so the messages in them are resent together
+
+		bool SendAggregate(bool reliable)
+		{
+			Aggregate& aggregate = aggregates[reliable];
+			if (!aggregate.packet.IsValid())
+				return true;
+			if (!CanSendPacket(aggregate.packet.GetSize()))
+				return false;
+			if (reliable ? !SendReliablePacket(aggregate.packet) : !SendPacket(aggregate.packet.GetData(), aggregate.packet.GetSize(), 0))
+				return false;
+			aggregate.packet.Reset();
+			return true;
+		}
+
+		void SendAggregates(bool flush)
+		{
+			for (int i = 0; i < 2; ++i)
+			{
+				if (aggregates[i].packet.IsValid() && (flush || time - aggregates[i].opened >= aggregationDelay))
+					SendAggregate(i != 0);
+			}
+		}
+
+		// pack a queued message, sending the datagram first if it would not fit and afterwards if nothing more could
+		//  + the first message packed is adopted as the datagram, so a message sent on its own is never copied
+
+		bool Pack(bool reliable, PacketHandle& message)
+		{
+			Aggregate& aggregate = aggregates[reliable];
+			if (aggregate.packet.IsValid() && aggregate.packet.GetSize() + message.GetSize() > GetMaxPayloadSize() && !SendAggregate(reliable))
+				return false;
+			if (!aggregate.packet.IsValid())
+			{
+				aggregate.packet = std::move(message);
+				aggregate.opened = time;
+			}
+			else
+			{
+				const int size = aggregate.packet.GetSize();
+				memcpy(aggregate.packet.GetData() + size, message.GetData(), message.GetSize());
+				aggregate.packet.SetSize(size + message.GetSize());
+				message.Reset();
+			}
+			if (aggregate.packet.GetSize() + ChannelHeaderSize + 1 > GetMaxPayloadSize())
+				SendAggregate(reliable);
+			return true;
+		}
+
+		// split a received datagram into its messages and apply each channel's delivery rule, stopping at anything malformed
+		//  + a datagram holding a single message is delivered in place, packed messages are copied out into their own buffers
+
+		void Unpack(PacketHandle& packet, int size)
+		{
+			unsigned char* payload = packet.GetData();
+			int offset = 0;
+			while (offset + ChannelHeaderSize < size)
+			{
+				const unsigned char* header = payload + offset;
+				const int index = header[0];
+				const int length = ReadLength(header);
+				const int end = offset + ChannelHeaderSize + length;
+				if (index >= channelCount || length == 0 || end > size)
+					return;
+				const unsigned short sequence = (unsigned short)(((unsigned int)header[1] << 8) | (unsigned int)header[2]);
+				if (Accept(channels[index], sequence))
+				{
+					PacketHandle message;
+					if (offset == 0 && end == size)
+					{
+						memmove(payload, payload + ChannelHeaderSize, length);
+						packet.SetSize(length);
+						message = std::move(packet);
+					}
+					else
+						message = PacketHandle::Allocate(header + ChannelHeaderSize, length);
+					if (channels[index].type == ReliableOrdered)
+						channels[index].reorder[sequence % ChannelWindow] = std::move(message);
+					else
+					{
+						assert(readyCount < (int)ready.size());
+						ReadyMessage& slot = ready[(readyHead + readyCount) % ready.size()];
+						slot.message = std::move(message);
+						slot.channel = index;
+						readyCount++;
+					}
+				}
+				offset = end;
+			}
+		}
+
+		void ResetChannel(Channel& channel)
+		{
+			channel.deficit = 0;
+			channel.turn = false;
+			for (size_t i = 0; i < channel.queue.size(); ++i)
+				channel.queue[i].Reset();
+			channel.queueHead = 0;
+			channel.queueCount = 0;
+			channel.sendSequence = 0;
+			channel.sentSequence = 0;
+			channel.sendBase = 0;
+			channel.receiveSequence = 0;
+			channel.receivedAny = false;
+			std::fill(channel.acked.begin(), channel.acked.end(), 0);
+			std::fill(channel.received.begin(), channel.received.end(), 0);
+			for (size_t i = 0; i < channel.reorder.size(); ++i)
+				channel.reorder[i].Reset();
+		}
+
+		// the front of the queue may go: reliable channels also need it to be inside the send window
+
+		bool CanSendChannel(const Channel& channel) const
+		{
+			if (channel.queueCount == 0)
+				return false;
+			if (channel.acked.empty())
+				return true;
+			return (unsigned short)(channel.sentSequence - channel.sendBase) < ChannelWindow;
+		}
+
+		// deficit round robin over the channel queues, until the queues are empty or blocked or the congestion window is full
+		//  + a channel gets weight * ChannelQuantum bytes more each time its turn comes round and packs messages while its
+		//    next one fits. when the congestion window fills mid turn the turn carries over to the next call, so a tight
+		//    window still shares out by weight
+
+		void SendQueued()
+		{
+			if (!IsConnected() && !IsConnecting())
+				return;
+			bool reliableBlocked = false;
+			int idle = 0;
+			while (idle < channelCount)
+			{
+				Channel& c = channels[nextChannel];
+				const bool reliable = !c.acked.empty();
+				if (!CanSendChannel(c) || (reliable && reliableBlocked))
+				{
+					c.deficit = c.queueCount > 0 ? c.deficit : 0;
+					c.turn = false;
+					nextChannel = (nextChannel + 1) % channelCount;
+					idle++;
+					continue;
+				}
+				if (!c.turn)
+				{
+					c.deficit += c.weight * ChannelQuantum;
+					c.turn = true;
+				}
+				while (CanSendChannel(c))
+				{
+					PacketHandle& packet = c.queue[c.queueHead];
+					const int size = packet.GetSize();
+					if (size > c.deficit)
+						break;
+					if (!Pack(reliable, packet))
+					{
+						// the congestion window is full, or the retransmit buffer or the socket refused the datagram
+						if (!reliable || !CanSendPacket(GetMaxPayloadSize()))
+							return;
+						reliableBlocked = true;
+						break;
+					}
+					c.deficit -= size;
+					c.queueHead = (c.queueHead + 1) % (int)c.queue.size();
+					c.queueCount--;
+					c.sentSequence++;
+					idle = 0;
+				}
+				c.deficit = c.queueCount > 0 ? c.deficit : 0;
+				c.turn = false;
+				nextChannel = (nextChannel + 1) % channelCount;
+			}
+		}
+
+		// the next message of a reliable ordered channel, if its reorder buffer has it
+
+		bool DeliverReordered(int& channel, PacketHandle& message)
+		{
+			for (int i = 0; i < channelCount; ++i)
+			{
+				Channel& c = channels[i];
+				if (c.type != ReliableOrdered)
+					continue;
+				const int slot = c.receiveSequence % ChannelWindow;
+				if (!c.received[slot])
+					continue;
+				message = std::move(c.reorder[slot]);
+				c.received[slot] = 0;
+				c.receiveSequence++;
+				channel = i;
+				return true;
+			}
+			return false;
+		}
+
+		// apply a channel's delivery rule to a received message, returns false if it is a duplicate or stale
+		//  + reliable channels flag each message received inside the window. unordered ones slide the window past the
+		//    first gap straight away, ordered ones as DeliverReordered hands the messages out
+
+		bool Accept(Channel& c, unsigned short sequence)
+		{
+			switch (c.type)
+			{
+				case ReliableOrdered:
+				case ReliableUnordered:
+				{
+					if ((unsigned short)(sequence - c.receiveSequence) >= ChannelWindow)
+						return false;
+					const int slot = sequence % ChannelWindow;
+					if (c.received[slot])
+						return false;
+					c.received[slot] = 1;
+					while (c.type == ReliableUnordered && c.received[c.receiveSequence % ChannelWindow])
+					{
+						c.received[c.receiveSequence % ChannelWindow] = 0;
+						c.receiveSequence++;
+					}
+					return true;
+				}
+
+				case UnreliableSequenced:
+					if (c.receivedAny && !sequence_more_recent(sequence, c.receiveSequence, 0xFFFF))
+						return false;
+					c.receivedAny = true;
+					c.receiveSequence = sequence;
+					return true;
+
+				default:
+					return true;
+			}
+		}
+
+		Channel channels[MaxChannels];
+		int channelCount;
+		int nextChannel;							// channel whose turn it is in the round robin
+		Aggregate aggregates[2];					// datagrams being packed, for unreliable and reliable channels
+		float aggregationDelay;
+		double time;								// seconds passed to Update, for the aggregation deadline
+		std::vector<ReadyMessage> ready;			// messages unpacked from the last datagram, waiting for ReceiveMessage
+		int readyHead;
+		int readyCount;
+	};
+
+	// open addressing hash map from address to an integer index, for finding a peer from the sender of a datagram
+	//  + linear probing over a power of two table kept at most half full, so lookups touch one or two cache lines
+	//  + removal shifts later entries of the probe run back instead of leaving tombstones, so lookups never degrade
+
+	class AddressMap
+	{
+	public:
+
+		AddressMap(int max_entries = 0)
+		{
+			count = 0;
+			if (max_entries > 0)
+				init(max_entries);
+		}
+
+		void init(int max_entries)
+		{
+			assert(max_entries > 0);
+			int capacity = 1;
+			while (capacity < max_entries * 2)
+				capacity *= 2;
+			slots.assign(capacity, Slot());
+			mask = capacity - 1;
+			count = 0;
+		}
+
+		void clear()
+		{
+			std::fill(slots.begin(), slots.end(), Slot());
+			count = 0;
+		}
+
+		int size() const
+		{
+			return count;
+		}
+
+		// index stored for address, or -1 if it is not in the map
+
+		int find(const Address& address) const
+		{
+			if (slots.empty())
+				return -1;
+			for (int i = hash(address) & mask; slots[i].index >= 0; i = (i + 1) & mask)
+			{
+				if (slots[i].address == address)
+					return slots[i].index;
+			}
+			return -1;
+		}
+
+		// insert or update address, returns false if the map is full
+
+		bool insert(const Address& address, int index)
+		{
+			assert(index >= 0);
+			if (slots.empty())
+				return false;
+			int i = hash(address) & mask;
+			for (; slots[i].index >= 0; i = (i + 1) & mask)
+			{
+				if (slots[i].address == address)
+				{
+					slots[i].index = index;
+					return true;
+				}
+			}
+			if ((count + 1) * 2 > (int)slots.size())
+				return false;
+			slots[i].address = address;
+			slots[i].index = index;
+			count++;
+			return true;
+		}
+
+		bool remove(const Address& address)
+		{
+			if (slots.empty())
+				return false;
+			int i = hash(address) & mask;
+			while (slots[i].index >= 0 && slots[i].address != address)
+				i = (i + 1) & mask;
+			if (slots[i].index < 0)
+				return false;
+
+			// backward shift: move each later entry of the run into the hole unless its home slot lies between the hole and it
+
+			int hole = i;
+			for (int j = (i + 1) & mask; slots[j].index >= 0; j = (j + 1) & mask)
+			{
+				const int home = hash(slots[j].address) & mask;
+				if (((j - home) & mask) >= ((j - hole) & mask))
+				{
+					slots[hole] = slots[j];
+					hole = j;
+				}
+			}
+			slots[hole] = Slot();
+			count--;
+			return true;
+		}
+
+	private:
+
+		struct Slot
+		{
+			Slot() : index(-1) {}
+			Address address;
+			int index;			// -1 for an empty slot
+		};
+
+		static unsigned int hash(const Address& address)
+		{
+			unsigned long long key = ((unsigned long long)address.GetAddress() << 16) | address.GetPort();
+			key *= 0x9E3779B97F4A7C15ULL;
+			return (unsigned int)(key >> 32);
+		}
+
+		std::vector<Slot> slots;
+		int mask;				// slots.size() - 1
+		int count;				// number of occupied slots
+	};
+
+	// server side connection manager: one socket shared by every client, each with its own reliable connection state
+	//  + datagrams are demultiplexed by sender address, a valid packet from an unknown sender creates a new peer
+	//  + peers that time out are destroyed in Update, override the On* functions to set up or tear down per-peer state
+
+	const int DefaultMaxPeers = 4096;
+
+	class ConnectionManager
+	{
+	public:
+
+		ConnectionManager(unsigned int protocolId, float timeout, int maxPeers = DefaultMaxPeers)
+			: peerMap(maxPeers)
+		{
+			assert(maxPeers > 0);
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			this->maxPeers = maxPeers;
+			running = false;
+		}
+
+		virtual ~ConnectionManager()
+		{
+			if (IsRunning())
+				Stop();
+		}
+
+		bool Start(int port, bool reusePort = false)
+		{
+			assert(!running);
+			printf("start connection manager on port %d\n", port);
+			if (!socket.Open(port, reusePort))
+				return false;
+			running = true;
+			return true;
+		}
 
-		bool IsConnected() const
+		void Stop()
 		{
-			return state == Connected;
+			assert(running);
+			printf("stop connection manager\n");
+			while (!peers.empty())
+				RemovePeer((int)peers.size() - 1);
+			socket.Close();
+			running = false;
 		}
 
-		bool IsListening() const
+		bool IsRunning() const
 		{
-			return state == Listening;
+			return running;
 		}
 
-		Mode GetMode() const
+		const Socket& GetSocket() const
 		{
-			return mode;
+			return socket;
 		}
 
-		virtual void Update(float deltaTime)
+		Socket& GetSocket()
+		{
+			return socket;
+		}
+
+		int GetPeerCount() const
+		{
+			return (int)peers.size();
+		}
+
+		// peers are kept densely packed, removing one moves the last peer into its index
+
+		ReliableConnection* GetPeer(int index)
+		{
+			assert(index >= 0 && index < (int)peers.size());
+			return peers[index];
+		}
+
+		ReliableConnection* FindPeer(const Address& address)
+		{
+			const int index = peerMap.find(address);
+			return index >= 0 ? peers[index] : NULL;
+		}
+
+		// drain up to count packets from the shared socket, returns the number of payloads accepted
+		//  + each packets[i].data must hold size bytes, on return address is the peer each payload came from
+		//  + headers are scattered aside and parsed in place, payloads land straight in the caller's buffers (which may be swapped)
+		//  + datagrams, if given, is set to the number read from the socket, as for Connection::ReceivePackets
+
+		int ReceivePackets(Datagram packets[], int count, int size, int* datagrams = NULL)
 		{
 			assert(running);
-			timeoutAccumulator += deltaTime;
-			if (timeoutAccumulator > timeout)
+			assert(packets);
+			const int stride = 4 + ReliableConnection::ReliabilityHeaderSize;
+			if ((int)batchHeaders.size() < count * stride)
+				batchHeaders.resize(count * stride);
+			const int received = socket.ReceiveBatch(packets, count, size, &batchHeaders[0], stride);
+			if (datagrams)
+				*datagrams = received;
+			int accepted = 0;
+			for (int i = 0; i < received; ++i)
 			{
-				if (state == Connecting)
+				const unsigned char* header = &batchHeaders[i * stride];
+				if (packets[i].size <= 4)
+					continue;
+				int index = peerMap.find(packets[i].address);
+				if (index < 0)
 				{
-					printf("connect timed out\n");
-					ClearData();
-					state = ConnectFail;
-					OnDisconnect();
+					index = AddPeer(packets[i].address, header);
+					if (index < 0)
+						continue;
 				}
-				else if (state == Connected)
+				const int payload = peers[index]->ProcessPacket(packets[i].address, header, packets[i].data, size, packets[i].size);
+				if (payload <= 0)
+					continue;
+				if (accepted != i)
 				{
-					printf("connection timed out\n");
-					ClearData();
-					if (state == Connecting)
-						state = ConnectFail;
-					OnDisconnect();
+					std::swap(packets[accepted].data, packets[i].data);
+					packets[accepted].address = packets[i].address;
 				}
+				packets[accepted].size = payload;
+				accepted++;
 			}
+			return accepted;
 		}
 
-		virtual bool SendPacket(const unsigned char data[], int size)
-		{
-			assert(running);
-			if (address.GetAddress() == 0)
-				return false;
-			unsigned char packet[PacketSizeHack + 4];
-			packet[0] = (unsigned char)(protocolId >> 24);
-			packet[1] = (unsigned char)((protocolId >> 16) & 0xFF);
-			packet[2] = (unsigned char)((protocolId >> 8) & 0xFF);
-			packet[3] = (unsigned char)((protocolId) & 0xFF);
-			std::memcpy(packet, data, PacketSizeHack);
-			return socket.Send(address, packet, PacketSizeHack + 4);
-		}
+		// update every peer, destroying those that timed out
 
-		virtual int ReceivePacket(unsigned char data[], int size)
+		void Update(float deltaTime)
 		{
 			assert(running);
-			unsigned char packet[PacketSizeHack + 4];
-			Address sender;
-			int bytes_read = socket.Receive(sender, packet, PacketSizeHack + 4);
-			if (bytes_read == 0)
-				return 0;
-			if (bytes_read <= 4)
-				return 0;
-			if (packet[0] != (unsigned char)(protocolId >> 24) ||
-				packet[1] != (unsigned char)((protocolId >> 16) & 0xFF) ||
-				packet[2] != (unsigned char)((protocolId >> 8) & 0xFF) ||
-				packet[3] != (unsigned char)(protocolId & 0xFF))
-				return 0;
-			if (mode == Server && !IsConnected())
-			{
-				printf("server accepts connection from client %d.%d.%d.%d:%d\n",
-					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
-				state = Connected;
-				address = sender;
-				OnConnect();
-			}
-			if (sender == address)
+			int i = 0;
+			while (i < (int)peers.size())
 			{
-				if (mode == Client && state == Connecting)
-				{
-					printf("client completes connection with server\n");
-					state = Connected;
-					OnConnect();
-				}
-				timeoutAccumulator = 0.0f;
-				memcpy(data, &packet[4], bytes_read - 4);
-				return bytes_read - 4;
+				peers[i]->Update(deltaTime);
+				if (peers[i]->IsConnected())
+					++i;
+				else
+					RemovePeer(i);
 			}
-			return 0;
+			socket.Flush();
 		}
 
-		int GetHeaderSize() const
+		// seconds until the earliest peer deadline, for sleeping in a reactor
+
+		float GetTimeUntilNextUpdate() const
 		{
-			return 4;
+			float deadline = timeout;
+			for (size_t i = 0; i < peers.size(); ++i)
+				deadline = std::min(deadline, peers[i]->GetTimeUntilNextUpdate());
+			return deadline;
 		}
 
 	protected:
 
-		virtual void OnStart() {}
-		virtual void OnStop() {}
-		virtual void OnConnect() {}
-		virtual void OnDisconnect() {}
+		// create the connection for a new peer, override to use a class derived from ReliableConnection
+
+		virtual ReliableConnection* CreatePeer()
+		{
+			return new ReliableConnection(protocolId, timeout);
+		}
+
+		// called when a peer is created, before its first packet is processed, and just before it is destroyed
+
+		virtual void OnPeerConnect(ReliableConnection& peer) {}
+		virtual void OnPeerDisconnect(ReliableConnection& peer) {}
 
 	private:
 
-		void ClearData()
+		// create a peer for the sender of a packet with our protocol id (in any header format), returns its index or -1 if it was rejected
+
+		int AddPeer(const Address& address, const unsigned char header[])
 		{
-			state = Disconnected;
-			timeoutAccumulator = 0.0f;
-			address = Address();
+			if (header[0] != (unsigned char)(protocolId >> 24) ||
+				header[1] != (unsigned char)((protocolId >> 16) & 0xFF) ||
+				header[2] != (unsigned char)((protocolId >> 8) & 0xFF) ||
+				((header[3] ^ protocolId) & ~(unsigned int)ReliableConnection::FormatMask & 0xFF))
+				return -1;
+			if ((int)peers.size() >= maxPeers)
+				return -1;
+			ReliableConnection* peer = CreatePeer();
+			peer->Attach(socket);
+			peer->Listen();
+			const int index = (int)peers.size();
+			peers.push_back(peer);
+			peerAddresses.push_back(address);
+			peerMap.insert(address, index);
+			OnPeerConnect(*peer);
+			return index;
 		}
 
-		enum State
+		void RemovePeer(int index)
 		{
-			Disconnected,
-			Listening,
-			Connecting,
-			ConnectFail,
-			Connected
-		};
+			ReliableConnection* peer = peers[index];
+			OnPeerDisconnect(*peer);
+			peerMap.remove(peerAddresses[index]);
+			const int last = (int)peers.size() - 1;
+			if (index != last)
+			{
+				peers[index] = peers[last];
+				peerAddresses[index] = peerAddresses[last];
+				peerMap.insert(peerAddresses[index], index);
+			}
+			peers.pop_back();
+			peerAddresses.pop_back();
+			peer->Stop();
+			delete peer;
+		}
 
 		unsigned int protocolId;
 		float timeout;
-
+		int maxPeers;
 		bool running;
-		Mode mode;
-		State state;
-		Socket socket;
-		float timeoutAccumulator;
-		Address address;
+		Socket socket;								// socket shared by all peers
+		std::vector<ReliableConnection*> peers;		// connected peers, densely packed
+		std::vector<Address> peerAddresses;			// address of each peer, kept here since a timed out connection forgets its own
+		AddressMap peerMap;							// peer address -> index in peers
+		std::vector<unsigned char> batchHeaders;	// protocol id and reliability header of each packet in a batch
 	};
 
-	// packet queue to store information about sent and received packets sorted in sequence order
-	//  + we define ordering using the "sequence_more_recent" function, this works provided there is a large gap when sequence wrap occurs
-
-	struct PacketData
-	{
-		unsigned int sequence;			// packet sequence number
-		float time;					    // time offset since packet was sent or received (depending on context)
-		int size;						// packet size in bytes
-	};
+	// sharded server: one ConnectionManager per cpu core, all bound to the same port with SO_REUSEPORT
+	//  + the kernel spreads datagrams across the sockets by source address, so a peer always lands on the same shard
+	//  + each shard runs on its own worker thread pinned to a core and is the only thread to touch its peers
+	//  + optional steering attaches a reuseport bpf program so shard = (source ip ^ source port) % shards exactly
+	//  + override the OnShard* functions to handle packets and send, they run on the shard's worker thread
 
-	inline bool sequence_more_recent(unsigned int s1, unsigned int s2, unsigned int max_sequence)
-	{
-		auto half_max = max_sequence / 2;
-		return (
-			((s1 > s2) && (s1 - s2 <= half_max))
-			||
-			((s2 > s1) && (s2 - s1 > half_max))
-			);
-	}
+	const int ShardBatchSize = 64;
+	const float ShardMaxWaitTime = 0.05f;
 
-	class PacketQueue : public std::list<PacketData>
+	class ShardedServer
 	{
 	public:
 
-		bool exists(unsigned int sequence)
+		ShardedServer(unsigned int protocolId, float timeout, int shardCount = 0, int maxPeersPerShard = DefaultMaxPeers)
 		{
-			for (iterator itor = begin(); itor != end(); ++itor)
-				if (itor->sequence == sequence)
-					return true;
-			return false;
+			if (shardCount <= 0)
+				shardCount = std::max((int)std::thread::hardware_concurrency(), 1);
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			this->shardCount = shardCount;
+			this->maxPeersPerShard = maxPeersPerShard;
+			running = false;
 		}
 
-		void insert_sorted(const PacketData& p, unsigned int max_sequence)
+		virtual ~ShardedServer()
 		{
-			if (empty())
-			{
-				push_back(p);
-			}
-			else
-			{
-				if (!sequence_more_recent(p.sequence, front().sequence, max_sequence))
-				{
-					push_front(p);
-				}
-				else if (sequence_more_recent(p.sequence, back().sequence, max_sequence))
-				{
-					push_back(p);
-				}
-				else
-				{
-					for (PacketQueue::iterator itor = begin(); itor != end(); itor++)
-					{
-						assert(itor->sequence != p.sequence);
-						if (sequence_more_recent(itor->sequence, p.sequence, max_sequence))
-						{
-							insert(itor, p);
-							break;
-						}
-					}
-				}
-			}
+			if (IsRunning())
+				Stop();
 		}
 
-		void verify_sorted(unsigned int max_sequence)
+		bool Start(int port, bool steering = false)
 		{
-			PacketQueue::iterator prev = end();
-			for (PacketQueue::iterator itor = begin(); itor != end(); itor++)
+			assert(!IsRunning());
+			printf("start sharded server on port %d with %d shards\n", port, shardCount);
+
+			// sockets join the reuseport group in order, which is the index the steering program returns
+
+			for (int i = 0; i < shardCount; ++i)
 			{
-				assert(itor->sequence <= max_sequence);
-				if (prev != end())
+				ConnectionManager* manager = new ConnectionManager(protocolId, timeout, maxPeersPerShard);
+				managers.push_back(manager);
+				if (!manager->Start(port, true))
 				{
-					assert(sequence_more_recent(itor->sequence, prev->sequence, max_sequence));
-					prev = itor;
+					Stop();
+					return false;
 				}
 			}
-		}
-	};
-
-	// reliability system to support reliable connection
-	//  + manages sent, received, pending ack and acked packet queues
-	//  + separated out from reliable connection because it is quite complex and i want to unit test it!
-
-	class ReliabilitySystem
-	{
-	public:
-
-		ReliabilitySystem(unsigned int max_sequence = 0xFFFFFFFF)
-		{
-			this->rtt_maximum = rtt_maximum;
-			this->max_sequence = max_sequence;
-			Reset();
-		}
 
-		void Reset()
-		{
-			local_sequence = 0;
-			remote_sequence = 0;
-			sentQueue.clear();
-			receivedQueue.clear();
-			pendingAckQueue.clear();
-			ackedQueue.clear();
-			sent_packets = 0;
-			recv_packets = 0;
-			lost_packets = 0;
-			acked_packets = 0;
-			sent_bandwidth = 0.0f;
-			acked_bandwidth = 0.0f;
-			rtt = 0.0f;
-			rtt_maximum = 1.0f;
-		}
+			if (steering && !AttachSteering(managers[0]->GetSocket(), shardCount))
+			{
+				printf("failed to attach reuseport steering program\n");
+				Stop();
+				return false;
+			}
 
-		void PacketSent(int size)
-		{
-			if (sentQueue.exists(local_sequence))
+			running = true;
+			for (int i = 0; i < shardCount; ++i)
 			{
-				printf("local sequence %d exists\n", local_sequence);
-				for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor)
-					printf(" + %d\n", itor->sequence);
+				threads.push_back(std::thread(&ShardedServer::Run, this, i));
+				PinThread(threads.back(), i % std::max((int)std::thread::hardware_concurrency(), 1));
 			}
-			assert(!sentQueue.exists(local_sequence));
-			assert(!pendingAckQueue.exists(local_sequence));
-			PacketData data;
-			data.sequence = local_sequence;
-			data.time = 0.0f;
-			data.size = PacketSizeHack;
-			sentQueue.push_back(data);
-			pendingAckQueue.push_back(data);
-			sent_packets++;
-			local_sequence++;
-			if (local_sequence > max_sequence)
-				local_sequence = 0;
+			return true;
 		}
 
-		void PacketReceived(unsigned int sequence, int size)
+		void Stop()
 		{
-			recv_packets++;
-			if (receivedQueue.exists(sequence))
-				return;
-			PacketData data;
-			data.sequence = sequence;
-			data.time = 0.0f;
-			data.size = PacketSizeHack;
-			receivedQueue.push_back(data);
-			if (sequence_more_recent(sequence, remote_sequence, max_sequence))
-				remote_sequence = sequence;
+			printf("stop sharded server\n");
+			running = false;
+			for (size_t i = 0; i < threads.size(); ++i)
+				threads[i].join();
+			threads.clear();
+			for (size_t i = 0; i < managers.size(); ++i)
+				delete managers[i];
+			managers.clear();
 		}
 
-		unsigned int GenerateAckBits()
+		bool IsRunning() const
 		{
-			return generate_ack_bits(GetRemoteSequence(), receivedQueue, max_sequence);
+			return running;
 		}
 
-		void ProcessAck(unsigned int ack, unsigned int ack_bits)
+		int GetShardCount() const
 		{
-			process_ack(ack, ack_bits, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, max_sequence);
+			return shardCount;
 		}
 
-		void Update(float deltaTime)
-		{
-			acks.clear();
-			AdvanceQueueTime(deltaTime);
-			UpdateQueues();
-			UpdateStats();
-#ifdef NET_UNIT_TEST
-			Validate();
-#endif
-		}
+		// a shard's manager may only be used from its own worker thread while the server runs
 
-		void Validate()
+		ConnectionManager& GetShard(int index)
 		{
-			sentQueue.verify_sorted(max_sequence);
-			receivedQueue.verify_sorted(max_sequence);
-			pendingAckQueue.verify_sorted(max_sequence);
-			ackedQueue.verify_sorted(max_sequence);
+			assert(index >= 0 && index < (int)managers.size());
+			return *managers[index];
 		}
 
-		// utility functions
+	protected:
 
-	/*
-		static bool sequence_more_recent( unsigned int s1, unsigned int s2, unsigned int max_sequence )
-		{
-			return ( s1 > s2 ) && ( s1 - s2 <= max_sequence/2 ) || ( s2 > s1 ) && ( s2 - s1 > max_sequence/2 );
-		}
-	*/
+		// called on the shard's worker thread: once at start, for each batch of received payloads, every pass before the peers update, and once at stop
 
-		static int bit_index_for_sequence(unsigned int sequence, unsigned int ack, unsigned int max_sequence)
-		{
-			assert(sequence != ack);
-			assert(!sequence_more_recent(sequence, ack, max_sequence));
-			if (sequence > ack)
-			{
-				assert(ack < 33);
-				assert(max_sequence >= sequence);
-				return ack + (max_sequence - sequence);
-			}
-			else
-			{
-				assert(ack >= 1);
-				assert(sequence <= ack - 1);
-				return ack - 1 - sequence;
-			}
-		}
+		virtual void OnShardStart(int shard, ConnectionManager& manager) {}
+		virtual void OnShardPackets(int shard, ConnectionManager& manager, const Datagram packets[], int count) {}
+		virtual void OnShardUpdate(int shard, ConnectionManager& manager, float deltaTime) {}
+		virtual void OnShardStop(int shard, ConnectionManager& manager) {}
 
-		static unsigned int generate_ack_bits(unsigned int ack, const PacketQueue& received_queue, unsigned int max_sequence)
-		{
-			unsigned int ack_bits = 0;
-			for (PacketQueue::const_iterator itor = received_queue.begin(); itor != received_queue.end(); itor++)
-			{
-				if (itor->sequence == ack || sequence_more_recent(itor->sequence, ack, max_sequence))
-					break;
-				int bit_index = bit_index_for_sequence(itor->sequence, ack, max_sequence);
-				if (bit_index <= 31)
-					ack_bits |= 1 << bit_index;
-			}
-			return ack_bits;
-		}
+	private:
 
-		static void process_ack(unsigned int ack, unsigned int ack_bits,
-			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
-			std::vector<unsigned int>& acks, unsigned int& acked_packets,
-			float& rtt, unsigned int max_sequence)
+		// worker loop for one shard: receive, let the application send, update peers, then sleep until the next packet or deadline
+
+		void Run(int shard)
 		{
-			if (pending_ack_queue.empty())
+			ConnectionManager& manager = *managers[shard];
+
+			Reactor reactor;
+			if (!reactor.Open() || !reactor.Add(manager.GetSocket()))
 				return;
 
-			PacketQueue::iterator itor = pending_ack_queue.begin();
-			while (itor != pending_ack_queue.end())
+			std::vector<unsigned char> buffer(ShardBatchSize * MaxDatagramSize);
+			Datagram packets[ShardBatchSize];
+			for (int i = 0; i < ShardBatchSize; ++i)
+				packets[i].data = &buffer[i * MaxDatagramSize];
+
+			OnShardStart(shard, manager);
+
+			double previousTime = get_time();
+			while (running)
 			{
-				bool acked = false;
+				const double currentTime = get_time();
+				const float deltaTime = (float)(currentTime - previousTime);
+				previousTime = currentTime;
 
-				if (itor->sequence == ack)
+				int datagrams = 0;
+				do
 				{
-					acked = true;
+					const int received = manager.ReceivePackets(packets, ShardBatchSize, MaxDatagramSize, &datagrams);
+					if (received > 0)
+						OnShardPackets(shard, manager, packets, received);
 				}
-				else if (!sequence_more_recent(itor->sequence, ack, max_sequence))
-				{
-					int bit_index = bit_index_for_sequence(itor->sequence, ack, max_sequence);
-					if (bit_index <= 31)
-						acked = (ack_bits >> bit_index) & 1;
-				}
-
-				if (acked)
-				{
-					rtt += (itor->time - rtt) * 0.1f;
+				while (datagrams > 0);
 
-					acked_queue.insert_sorted(*itor, max_sequence);
-					acks.push_back(itor->sequence);
-					acked_packets++;
-					itor = pending_ack_queue.erase(itor);
-				}
-				else
-					++itor;
-			}
-		}
+				OnShardUpdate(shard, manager, deltaTime);
+				manager.Update(deltaTime);
 
-		// data accessors
+				reactor.Wait(std::min(manager.GetTimeUntilNextUpdate(), ShardMaxWaitTime));
+			}
 
-		unsigned int GetLocalSequence() const
-		{
-			return local_sequence;
+			OnShardStop(shard, manager);
 		}
 
-		unsigned int GetRemoteSequence() const
+		static void PinThread(std::thread& thread, int cpu)
 		{
-			return remote_sequence;
+#if defined(__linux__)
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(cpu, &cpus);
+			pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#elif PLATFORM == PLATFORM_WINDOWS
+			SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << cpu);
+#endif
 		}
 
-		unsigned int GetMaxSequence() const
-		{
-			return max_sequence;
-		}
+		// classic bpf run by the kernel on each datagram to pick the socket: (source ip ^ source port) % shards
+		//  + offsets are relative to the ip header and assume ipv4 without options, which is all Socket opens
 
-		void GetAcks(unsigned int** acks, int& count)
+		static bool AttachSteering(const Socket& socket, int shards)
 		{
-			*acks = &this->acks[0];
-			count = (int)this->acks.size();
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+			sock_filter code[] =
+			{
+				{ BPF_LD | BPF_W | BPF_ABS, 0, 0, (unsigned int)(SKF_NET_OFF + 12) },		// A = source ip
+				{ BPF_MISC | BPF_TAX, 0, 0, 0 },											// X = A
+				{ BPF_LD | BPF_H | BPF_ABS, 0, 0, (unsigned int)(SKF_NET_OFF + 20) },		// A = source port
+				{ BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },										// A ^= X
+				{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned int)shards },					// A %= shards
+				{ BPF_RET | BPF_A, 0, 0, 0 },
+			};
+			sock_fprog program;
+			program.len = sizeof(code) / sizeof(code[0]);
+			program.filter = code;
+			return setsockopt(socket.GetHandle(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+#else
+			return false;
+#endif
 		}
 
-		unsigned int GetSentPackets() const
-		{
-			return sent_packets;
-		}
+		unsigned int protocolId;
+		float timeout;
+		int shardCount;
+		int maxPeersPerShard;
+		std::atomic<bool> running;					// cleared by Stop to end the worker loops
+		std::vector<ConnectionManager*> managers;	// one per shard, only touched by that shard's thread while running
+		std::vector<std::thread> threads;			// worker thread per shard
+	};
 
-		unsigned int GetReceivedPackets() const
+	// bounded lock-free ring queues for handing items between threads
+	//  + capacity is rounded up to a power of two, push and pop move items in batches and return how many moved
+	//  + the producer and consumer indices sit on their own cache lines, each side keeps a cached copy of the other's
+	//    index so it only touches the shared line when its cached view says the queue is full or empty
+
+	const int CacheLineSize = 64;
+	const int DefaultQueueCapacity = 1024;
+
+	inline unsigned int QueueCapacity(int capacity)
+	{
+		assert(capacity > 0);
+		unsigned int size = 1;
+		while (size < (unsigned int)capacity)
+			size <<= 1;
+		return size;
+	}
+
+	// one producer thread, one consumer thread
+
+	template <typename T> class SpscQueue
+	{
+	public:
+
+		explicit SpscQueue(int capacity = DefaultQueueCapacity)
+			: items(QueueCapacity(capacity)), head(0), tail(0)
 		{
-			return recv_packets;
+			mask = (unsigned int)items.size() - 1;
+			cachedTail = 0;
+			cachedHead = 0;
 		}
 
-		unsigned int GetLostPackets() const
+		// producer side, items are moved from
+
+		int Push(T values[], int count)
 		{
-			return lost_packets;
+			const unsigned int position = tail.load(std::memory_order_relaxed);
+			if (position - cachedHead + count > items.size())
+				cachedHead = head.load(std::memory_order_acquire);
+			const int pushed = std::min(count, (int)(items.size() - (position - cachedHead)));
+			for (int i = 0; i < pushed; ++i)
+				items[(position + i) & mask] = std::move(values[i]);
+			tail.store(position + pushed, std::memory_order_release);
+			return pushed;
 		}
 
-		unsigned int GetAckedPackets() const
+		bool Push(T& value)
 		{
-			return acked_packets;
+			return Push(&value, 1) == 1;
 		}
 
-		float GetSentBandwidth() const
+		// consumer side
+
+		int Pop(T values[], int count)
 		{
-			return sent_bandwidth;
+			const unsigned int position = head.load(std::memory_order_relaxed);
+			if (cachedTail - position < (unsigned int)count)
+				cachedTail = tail.load(std::memory_order_acquire);
+			const int popped = std::min(count, (int)(cachedTail - position));
+			for (int i = 0; i < popped; ++i)
+				values[i] = std::move(items[(position + i) & mask]);
+			head.store(position + popped, std::memory_order_release);
+			return popped;
 		}
 
-		float GetAckedBandwidth() const
+		bool Pop(T& value)
 		{
-			return acked_bandwidth;
+			return Pop(&value, 1) == 1;
 		}
 
-		float GetRoundTripTime() const
+		// approximate when read from a thread that is neither side
+
+		int GetCount() const
 		{
-			return rtt;
+			return (int)(tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
 		}
 
-		int GetHeaderSize() const
+		int GetCapacity() const
 		{
-			return 12;
+			return (int)items.size();
 		}
 
-	protected:
-
-		void AdvanceQueueTime(float deltaTime)
-		{
-			for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); itor++)
-				itor->time += deltaTime;
+	private:
 
-			for (PacketQueue::iterator itor = receivedQueue.begin(); itor != receivedQueue.end(); itor++)
-				itor->time += deltaTime;
+		std::vector<T> items;
+		unsigned int mask;
+		char padding0[CacheLineSize];
+		std::atomic<unsigned int> head;			// next item to pop, written by the consumer
+		unsigned int cachedTail;				// consumer's last view of tail
+		char padding1[CacheLineSize];
+		std::atomic<unsigned int> tail;			// next free item, written by the producer
+		unsigned int cachedHead;				// producer's last view of head
+		char padding2[CacheLineSize];
+	};
 
-			for (PacketQueue::iterator itor = pendingAckQueue.begin(); itor != pendingAckQueue.end(); itor++)
-				itor->time += deltaTime;
+	// any number of producer threads, one consumer thread
+	//  + a producer claims a run of cells with one compare and swap on tail, fills them, then marks each one ready
+	//  + the consumer pops ready cells in order and frees them by publishing head, so a slow producer holds up
+	//    the cells behind its own but never corrupts them
 
-			for (PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); itor++)
-				itor->time += deltaTime;
-		}
+	template <typename T> class MpscQueue
+	{
+	public:
 
-		void UpdateQueues()
+		explicit MpscQueue(int capacity = DefaultQueueCapacity)
+			: cells(QueueCapacity(capacity)), head(0), tail(0)
 		{
-			const float epsilon = 0.001f;
+			mask = (unsigned int)cells.size() - 1;
+		}
 
-			while (sentQueue.size() && sentQueue.front().time > rtt_maximum + epsilon)
-				sentQueue.pop_front();
+		// producer side, safe from any thread, items are moved from
 
-			if (receivedQueue.size())
+		int Push(T values[], int count)
+		{
+			unsigned int position = tail.load(std::memory_order_relaxed);
+			int claimed;
+			do
 			{
-				const unsigned int latest_sequence = receivedQueue.back().sequence;
-				const unsigned int minimum_sequence = latest_sequence >= 34 ? (latest_sequence - 34) : max_sequence - (34 - latest_sequence);
-				while (receivedQueue.size() && !sequence_more_recent(receivedQueue.front().sequence, minimum_sequence, max_sequence))
-					receivedQueue.pop_front();
+				const unsigned int used = position - head.load(std::memory_order_acquire);
+				claimed = std::min(count, (int)(cells.size() - used));
+				if (claimed <= 0)
+					return 0;
 			}
-
-			while (ackedQueue.size() && ackedQueue.front().time > rtt_maximum * 2 - epsilon)
-				ackedQueue.pop_front();
-
-			while (pendingAckQueue.size() && pendingAckQueue.front().time > rtt_maximum + epsilon)
+			while (!tail.compare_exchange_weak(position, position + claimed, std::memory_order_relaxed, std::memory_order_relaxed));
+			for (int i = 0; i < claimed; ++i)
 			{
-				pendingAckQueue.pop_front();
-				lost_packets++;
+				Cell& cell = cells[(position + i) & mask];
+				cell.value = std::move(values[i]);
+				cell.ready.store(position + i + 1, std::memory_order_release);
 			}
+			return claimed;
 		}
 
-		void UpdateStats()
+		bool Push(T& value)
+		{
+			return Push(&value, 1) == 1;
+		}
+
+		// consumer side
+
+		int Pop(T values[], int count)
 		{
-			int sent_bytes_per_second = 0;
-			for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor)
-				sent_bytes_per_second += itor->size;
-			int acked_packets_per_second = 0;
-			int acked_bytes_per_second = 0;
-			for (PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor)
+			unsigned int position = head.load(std::memory_order_relaxed);
+			int popped = 0;
+			while (popped < count)
 			{
-				if (itor->time >= rtt_maximum)
-				{
-					acked_packets_per_second++;
-					acked_bytes_per_second += itor->size;
-				}
+				Cell& cell = cells[position & mask];
+				if (cell.ready.load(std::memory_order_acquire) != position + 1)
+					break;
+				values[popped++] = std::move(cell.value);
+				position++;
 			}
-			sent_bytes_per_second /= rtt_maximum;
-			acked_bytes_per_second /= rtt_maximum;
-			sent_bandwidth = sent_bytes_per_second * (8 / 1000.0f);
-			acked_bandwidth = acked_bytes_per_second * (8 / 1000.0f);
+			head.store(position, std::memory_order_release);
+			return popped;
 		}
 
-	private:
+		bool Pop(T& value)
+		{
+			return Pop(&value, 1) == 1;
+		}
 
-		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
-		unsigned int local_sequence;		// local sequence number for most recently sent packet
-		unsigned int remote_sequence;		// remote sequence number for most recently received packet
+		// claimed cells, including ones a producer is still filling
 
-		unsigned int sent_packets;			// total number of packets sent
-		unsigned int recv_packets;			// total number of packets received
-		unsigned int lost_packets;			// total number of packets lost
-		unsigned int acked_packets;			// total number of packets acked
+		int GetCount() const
+		{
+			return (int)(tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
+		}
 
-		float sent_bandwidth;				// approximate sent bandwidth over the last second
-		float acked_bandwidth;				// approximate acked bandwidth over the last second
-		float rtt;							// estimated round trip time
-		float rtt_maximum;					// maximum expected round trip time (hard coded to one second for the moment)
+		int GetCapacity() const
+		{
+			return (int)cells.size();
+		}
 
-		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
+	private:
 
-		PacketQueue sentQueue;				// sent packets used to calculate sent bandwidth (kept until rtt_maximum)
-		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (kept until rtt_maximum * 2 )
-		PacketQueue receivedQueue;			// received packets for determining acks to send (kept up to most recent recv sequence - 32)
-		PacketQueue ackedQueue;				// acked packets (kept until rtt_maximum * 2)
+		struct Cell
+		{
+			Cell() : ready(0) {}
+
+			std::atomic<unsigned int> ready;	// position + 1 once the cell at position holds a value
+			T value;
+		};
+
+		std::vector<Cell> cells;
+		unsigned int mask;
+		char padding0[CacheLineSize];
+		std::atomic<unsigned int> head;			// next cell to pop, written by the consumer
+		char padding1[CacheLineSize];
+		std::atomic<unsigned int> tail;			// next cell to claim, advanced by producers
+		char padding2[CacheLineSize];
 	};
 
-	// connection with reliability (seq/ack)
+	// snapshot of a connection's statistics, published by the network thread
+
+	struct NetworkStats
+	{
+		NetworkStats()
+		{
+			rtt = 0.0f;
+			sentPackets = ackedPackets = lostPackets = 0;
+			sentBandwidth = ackedBandwidth = 0.0f;
+		}
+
+		float rtt;
+		unsigned int sentPackets;
+		unsigned int ackedPackets;
+		unsigned int lostPackets;
+		float sentBandwidth;
+		float ackedBandwidth;
+	};
 
-	class ReliableConnection : public Connection
+	// runs a reliable connection on its own thread, so disk or console stalls in the application do not delay acks
+	//  + the network thread owns the socket and the reliability system, application threads only touch the queues
+	//  + any thread may send, payloads go through a multi producer queue. received payloads come back through a single
+	//    consumer queue drained by one application thread. both carry pooled packet handles, so no bytes are copied
+	//  + backpressure: Send fails once the outbound queue is full, and IsSendBlocked says the network thread is holding
+	//    payloads back for the congestion window or pacer. when the application stops draining received payloads
+	//    the network thread stops reading the socket, which pushes back on the peer's congestion control
+	//  + set up the connection (Start, Connect or Listen) before starting the thread and leave it alone until it stops.
+	//    callbacks of the connection such as OnPacketDelivered run on the network thread
+
+	const int NetworkBatchSize = 64;
+	const float NetworkMaxWaitTime = 0.05f;
+	const float NetworkPollTime = 0.001f;
+
+	class NetworkThread
 	{
 	public:
 
-		ReliableConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF)
-			: Connection(protocolId, timeout), reliabilitySystem(max_sequence)
+		NetworkThread(ReliableConnection& connection, int queueCapacity = DefaultQueueCapacity)
+			: connection(connection), outbound(queueCapacity), inbound(queueCapacity),
+			  running(false), sleeping(false), blocked(false), connected(false), failed(false), droppedSends(0)
 		{
-			ClearData();
-#ifdef NET_UNIT_TEST
-			packet_loss_mask = 0;
-#endif
+			stagedIndex = stagedCount = 0;
+			borrowedEnd = NULL;
 		}
 
-		~ReliableConnection()
+		virtual ~NetworkThread()
 		{
 			if (IsRunning())
 				Stop();
 		}
 
-		// overriden functions from "Connection"
+		bool Start()
+		{
+			assert(!IsRunning());
+			assert(connection.IsRunning());
+			if (!reactor.Open() || !reactor.Add(connection.GetSocket()))
+			{
+				reactor.Close();
+				return false;
+			}
+			running = true;
+			thread = std::thread(&NetworkThread::Run, this);
+			return true;
+		}
 
-		bool SendPacket(const unsigned char data[], int size, int count)
+		void Stop()
 		{
-#ifdef NET_UNIT_TEST
-			if (reliabilitySystem.GetLocalSequence() & packet_loss_mask)
+			running = false;
+			reactor.Wake();
+			if (thread.joinable())
+				thread.join();
+			reactor.Close();
+			stagedIndex = stagedCount = 0;
+		}
+
+		bool IsRunning() const
+		{
+			return running;
+		}
+
+		// queue payloads to send, reliable ones are resent until acked. returns the number queued, the rest did not fit
+
+		int Send(const PacketHandle packets[], int count, bool reliable = false)
+		{
+			int queued = 0;
+			while (queued < count)
 			{
-				reliabilitySystem.PacketSent(PacketSizeHack);
-				return true;
+				Outgoing batch[NetworkBatchSize];
+				const int size = std::min(count - queued, (int)NetworkBatchSize);
+				for (int i = 0; i < size; ++i)
+				{
+					batch[i].packet = packets[queued + i];
+					batch[i].reliable = reliable;
+				}
+				const int pushed = outbound.Push(batch, size);
+				queued += pushed;
+				if (pushed < size)
+					break;
 			}
-#endif
-			count++;
-			char packetData[128] = "Hello world ";
-
-
-			const int header = 12;
-			unsigned char packet[header + PacketSizeHack];
-			unsigned int seq = reliabilitySystem.GetLocalSequence();
-			unsigned int ack = reliabilitySystem.GetRemoteSequence();
-			unsigned int ack_bits = reliabilitySystem.GenerateAckBits();
-			WriteHeader(packet, seq, ack, ack_bits);
-			std::memcpy(packet + header, data, PacketSizeHack);
-			std::memcpy(packet, packetData, sizeof(packetData));
-			if (!Connection::SendPacket(packet, PacketSizeHack + header))
+			if (queued > 0)
+				Notify();
+			return queued;
+		}
+
+		bool Send(const PacketHandle& packet, bool reliable = false)
+		{
+			return Send(&packet, 1, reliable) == 1;
+		}
+
+		// queue a reliable payload sent straight from the caller's memory, see ReliableConnection::SendBorrowedPacket
+		//  + borrowed payloads are expected in increasing address order, as when streaming a file. the memory must stay
+		//    valid until the network thread no longer reports it from GetLowestBorrowed or before GetBorrowedEnd
+
+		bool SendBorrowed(const unsigned char data[], int size)
+		{
+			assert(data && size > 0);
+			Outgoing outgoing;
+			outgoing.borrowed = data;
+			outgoing.size = size;
+			outgoing.reliable = true;
+			if (outbound.Push(&outgoing, 1) != 1)
 				return false;
-			reliabilitySystem.PacketSent(PacketSizeHack);
+			Notify();
 			return true;
 		}
 
-		int ReceivePacket(unsigned char data[], int size, unsigned char feedback[])
+		// take up to count received payloads, from one application thread only
+
+		int Receive(PacketHandle packets[], int count)
 		{
-			const int header = 12;
-			if (PacketSizeHack <= header)
-				return false;
-			unsigned char packet[header + PacketSizeHack];
-			int received_bytes = Connection::ReceivePacket(packet, PacketSizeHack + header);
-			if (received_bytes == 0)
-				return false;
-			if (received_bytes <= header)
-				return false;
-			unsigned int packet_sequence = 0;
-			unsigned int packet_ack = 0;
-			unsigned int packet_ack_bits = 0;
-			ReadHeader(packet, packet_sequence, packet_ack, packet_ack_bits);
-			reliabilitySystem.PacketReceived(packet_sequence, received_bytes - header);
-			reliabilitySystem.ProcessAck(packet_ack, packet_ack_bits);
-			std::memcpy(data, packet + header, received_bytes - header);
-			printf("%s", feedback);
-			return received_bytes - header;
+			return inbound.Pop(packets, count);
 		}
 
-		void Update(float deltaTime)
+		// free room in the outbound queue
+
+		int GetSendSpace() const
 		{
-			Connection::Update(deltaTime);
-			reliabilitySystem.Update(deltaTime);
+			return outbound.GetCapacity() - outbound.GetCount();
 		}
 
-		int GetHeaderSize() const
+		// the network thread has payloads it cannot send yet (congestion window, pacer or retransmit buffer full)
+
+		bool IsSendBlocked() const
 		{
-			return Connection::GetHeaderSize() + reliabilitySystem.GetHeaderSize();
+			return blocked.load(std::memory_order_relaxed);
 		}
 
-		ReliabilitySystem& GetReliabilitySystem()
+		bool IsConnected() const
 		{
-			return reliabilitySystem;
+			return connected.load(std::memory_order_relaxed);
 		}
 
-		// unit test controls
+		bool ConnectFailed() const
+		{
+			return failed.load(std::memory_order_relaxed);
+		}
 
-#ifdef NET_UNIT_TEST
-		void SetPacketLossMask(unsigned int mask)
+		// queued payloads that were dropped because they were larger than the connection can send
+
+		unsigned int GetDroppedSends() const
 		{
-			packet_loss_mask = mask;
+			return droppedSends.load(std::memory_order_relaxed);
+		}
+
+		NetworkStats GetStats() const
+		{
+			std::lock_guard<std::mutex> lock(statsMutex);
+			return stats;
 		}
-#endif
 
 	protected:
 
-		void WriteInteger(unsigned char* data, unsigned int value)
+		// called on the network thread after each update, before it goes back to sleep
+
+		virtual void OnNetworkUpdate(ReliableConnection& connection, float deltaTime) {}
+
+		// lowest address of a borrowed payload the connection holds or is waiting to send, NULL if none. from the network
+		// thread only, e.g. in OnNetworkUpdate
+
+		const unsigned char* GetLowestBorrowed() const
 		{
-			data[0] = (unsigned char)(value >> 24);
-			data[1] = (unsigned char)((value >> 16) & 0xFF);
-			data[2] = (unsigned char)((value >> 8) & 0xFF);
-			data[3] = (unsigned char)(value & 0xFF);
+			const unsigned char* lowest = connection.GetLowestBorrowed();
+			for (int i = stagedIndex; i < stagedCount; ++i)
+			{
+				if (staged[i].borrowed)
+				{
+					if (!lowest || staged[i].borrowed < lowest)
+						lowest = staged[i].borrowed;
+					break;
+				}
+			}
+			return lowest;
 		}
 
-		void WriteHeader(unsigned char* header, unsigned int sequence, unsigned int ack, unsigned int ack_bits)
+		// end of the last borrowed payload sent, NULL if none was. the ones still queued come after it, so with nothing
+		// borrowed in flight the memory before it is no longer needed. from the network thread only
+
+		const unsigned char* GetBorrowedEnd() const
 		{
-			WriteInteger(header, sequence);
-			WriteInteger(header + 4, ack);
-			WriteInteger(header + 8, ack_bits);
+			return borrowedEnd;
 		}
 
-		void ReadInteger(const unsigned char* data, unsigned int& value)
+	private:
+
+		struct Outgoing
 		{
-			value = (((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
-				((unsigned int)data[2] << 8) | ((unsigned int)data[3]));
-		}
+			Outgoing() : borrowed(NULL), size(0), reliable(false) {}
+
+			int GetSize() const
+			{
+				return borrowed ? size : packet.GetSize();
+			}
+
+			PacketHandle packet;
+			const unsigned char* borrowed;		// payload in the caller's memory instead of packet, always reliable
+			int size;
+			bool reliable;
+		};
+
+		// wake the network thread if it is asleep, the fences pair so either it sees the new payload or we see it sleeping
 
-		void ReadHeader(const unsigned char* header, unsigned int& sequence, unsigned int& ack, unsigned int& ack_bits)
+		void Notify()
 		{
-			ReadInteger(header, sequence);
-			ReadInteger(header + 4, ack);
-			ReadInteger(header + 8, ack_bits);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (sleeping.load(std::memory_order_relaxed))
+				reactor.Wake();
 		}
 
-		virtual void OnStop()
+		void Run()
 		{
-			ClearData();
+			Pacer pacer;
+			double previousTime = get_time();
+			pacer.Reset(previousTime);
+
+			while (running)
+			{
+				const double currentTime = get_time();
+				const float deltaTime = (float)(currentTime - previousTime);
+				previousTime = currentTime;
+
+				pacer.SetRate(connection.GetReliabilitySystem().GetPacingRate());
+
+				ReceivePayloads();
+				SendPayloads(pacer);
+
+				connection.Update(deltaTime);
+				Publish();
+				OnNetworkUpdate(connection, deltaTime);
+
+				// sleep until a packet, a deadline or a new payload to send. with the inbound queue full the socket stays
+				// readable, so poll the application instead
+				//  + staged payloads left over are blocked on the window or the pacer: the timeout covers the pacer and
+				//    acks that open the window make the socket readable, so only payloads queued since the last pop skip the wait
+
+				const double waitTime = get_time();
+				float timeout = std::min(NetworkMaxWaitTime, connection.GetTimeUntilNextUpdate());
+				if (stagedIndex < stagedCount && pacer.GetRate() > 0.0f && connection.CanSendPacket(staged[stagedIndex].GetSize()))
+				{
+					const int bytes = staged[stagedIndex].GetSize() + connection.GetHeaderSize();
+					timeout = std::min(timeout, (float)(pacer.GetNextSendTime(waitTime, bytes) - waitTime));
+				}
+				if (!Reactor::CanWake())
+					timeout = std::min(timeout, NetworkPollTime);
+
+				if (inbound.GetCount() == inbound.GetCapacity())
+				{
+					wait(std::min(timeout, NetworkPollTime));
+					continue;
+				}
+				sleeping.store(true, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (stagedIndex < stagedCount || outbound.GetCount() == 0)
+					reactor.Wait(timeout);
+				sleeping.store(false, std::memory_order_relaxed);
+			}
 		}
 
-		virtual void OnDisconnect()
+		// receive into pooled buffers and hand them over, never more than the inbound queue has room for
+
+		void ReceivePayloads()
 		{
-			ClearData();
+			Datagram packets[NetworkBatchSize];
+			while (true)
+			{
+				const int space = std::min(inbound.GetCapacity() - inbound.GetCount(), (int)NetworkBatchSize);
+				if (space <= 0)
+					return;
+				for (int i = 0; i < space; ++i)
+				{
+					received[i].MakeUnique();
+					packets[i].data = received[i].GetData();
+				}
+				int datagrams = 0;
+				const int count = connection.ReceivePackets(packets, space, MaxDatagramSize, &datagrams);
+				if (datagrams == 0)
+					return;
+				if (count == 0)
+					continue;
+
+				// accepted payloads may have been compacted into other buffers of the batch, follow them
+
+				for (int i = 0; i < count; ++i)
+				{
+					if (received[i].GetData() != packets[i].data)
+					{
+						for (int j = i + 1; j < space; ++j)
+						{
+							if (received[j].GetData() == packets[i].data)
+							{
+								std::swap(received[i], received[j]);
+								break;
+							}
+						}
+					}
+					received[i].SetSize(packets[i].size);
+				}
+				inbound.Push(received, count);
+			}
 		}
 
-	private:
+		// resend lost payloads, then send staged payloads while the congestion window and pacer allow, popping more from
+		// the queue a batch at a time
+		//  + without congestion control there is no pacing rate, and sends are only limited by the window
 
-		void ClearData()
+		void SendPayloads(Pacer& pacer)
 		{
-			reliabilitySystem.Reset();
+			if (pacer.GetRate() > 0.0f)
+				pacer.OnSent(connection.SendResends(pacer.GetBudget(get_time())));
+			while (true)
+			{
+				if (stagedIndex == stagedCount)
+				{
+					stagedIndex = 0;
+					stagedCount = outbound.Pop(staged, NetworkBatchSize);
+					if (stagedCount == 0)
+						break;
+				}
+				Outgoing& outgoing = staged[stagedIndex];
+				const int size = outgoing.GetSize();
+				if (size > connection.GetMaxPayloadSize())
+				{
+					droppedSends++;
+				}
+				else
+				{
+					const int bytes = size + connection.GetHeaderSize();
+					const bool paced = pacer.GetRate() > 0.0f;
+					if (!connection.CanSendPacket(size) || (paced && !pacer.CanSend(get_time(), bytes)))
+						break;
+					if (outgoing.borrowed)
+					{
+						if (!connection.SendBorrowedPacket(outgoing.borrowed, size))
+							break;
+					}
+					else if (outgoing.reliable)
+					{
+						if (!connection.SendReliablePacket(outgoing.packet))
+							break;
+					}
+					else
+						connection.SendPacket(outgoing.packet.GetData(), size, 0);
+					if (paced)
+						pacer.OnSent(bytes);
+				}
+				if (outgoing.borrowed)
+					borrowedEnd = outgoing.borrowed + size;
+				outgoing.packet.Reset();
+				outgoing.borrowed = NULL;
+				stagedIndex++;
+			}
+			blocked.store(stagedIndex < stagedCount, std::memory_order_relaxed);
 		}
 
-#ifdef NET_UNIT_TEST
-		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
-#endif
+		void Publish()
+		{
+			connected.store(connection.IsConnected(), std::memory_order_relaxed);
+			failed.store(connection.ConnectFailed(), std::memory_order_relaxed);
+			const ReliabilitySystem& reliability = connection.GetReliabilitySystem();
+			std::lock_guard<std::mutex> lock(statsMutex);
+			stats.rtt = reliability.GetRoundTripTime();
+			stats.sentPackets = reliability.GetSentPackets();
+			stats.ackedPackets = reliability.GetAckedPackets();
+			stats.lostPackets = reliability.GetLostPackets();
+			stats.sentBandwidth = reliability.GetSentBandwidth();
+			stats.ackedBandwidth = reliability.GetAckedBandwidth();
+		}
 
-		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+		ReliableConnection& connection;
+		MpscQueue<Outgoing> outbound;				// application -> network thread
+		SpscQueue<PacketHandle> inbound;			// network thread -> application
+		Outgoing staged[NetworkBatchSize];			// popped from outbound, waiting for the window to open
+		int stagedIndex, stagedCount;
+		const unsigned char* borrowedEnd;			// end of the last borrowed payload sent from staged
+		PacketHandle received[NetworkBatchSize];	// receive buffers, only touched by the network thread
+		Reactor reactor;
+		std::thread thread;
+		std::atomic<bool> running;
+		std::atomic<bool> sleeping;					// network thread is (about to be) waiting in the reactor
+		std::atomic<bool> blocked;
+		std::atomic<bool> connected;
+		std::atomic<bool> failed;
+		std::atomic<unsigned int> droppedSends;
+		mutable std::mutex statsMutex;
+		NetworkStats stats;
 	};
 }
 
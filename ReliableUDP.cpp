@@ -10,8 +10,11 @@
 #include <vector>
 
 #include "Net.h"
+#include "FileOperations.h"
 
 //#define SHOW_ACKS
+//#define SHOW_PACKETS
+//#define NETWORK_THREAD
 
 using namespace std;
 using namespace net;
@@ -19,104 +22,135 @@ using namespace net;
 const int ServerPort = 30000;
 const int ClientPort = 30001;
 const int ProtocolId = 0x11223344;
-const float DeltaTime = 1.0f / 30.0f;
+const float MaxWaitTime = 1.0f / 30.0f;
 const float SendRate = 1.0f / 30.0f;
 const float TimeOut = 10.0f;
 const int PacketSize = 256;
+const int ReceiveBatchSize = 32;
 
 const int FileNameLength = 256;
+const float ReadAheadWait = 0.001f;
+const int MaxReadAheadWaits = 50;
 
-class FlowControl
+// ----------------------------------------------
+
+#ifdef NETWORK_THREAD
+
+// threaded mode: a network thread runs the connection, this thread only queues payloads and reads stats,
+// so slow console or file work here cannot delay acks
+//  + file chunks are queued straight out of the mapping, the network thread releases the pages behind the oldest
+//    chunk still waiting for its ack, or behind the last chunk sent once all are acked, as the single-threaded loop does
+
+class FileNetworkThread : public NetworkThread
 {
 public:
 
-	FlowControl()
+	FileNetworkThread(ReliableConnection& connection, MappedFile& file) : NetworkThread(connection), file(file) {}
+
+	virtual void OnNetworkUpdate(ReliableConnection& connection, float deltaTime)
 	{
-		printf("flow control initialized\n");
-		Reset();
+		const unsigned char* lowest = GetLowestBorrowed();
+		if (!lowest)
+			lowest = GetBorrowedEnd();
+		if (lowest)
+			file.Release(lowest - file.GetData());
 	}
 
-	void Reset()
+private:
+
+	MappedFile& file;
+};
+
+int RunNetworkThread(ReliableConnection& connection, MappedFile& file, const char fileName[])
+{
+	FileNetworkThread network(connection, file);
+	if (!network.Start())
 	{
-		mode = Bad;
-		penalty_time = 4.0f;
-		good_conditions_time = 0.0f;
-		penalty_reduction_accumulator = 0.0f;
+		printf("could not start network thread\n");
+		return 1;
 	}
 
-	void Update(float deltaTime, float rtt)
+	bool connected = false;
+	long long fileOffset = 0;
+	int readAheadWaits = 0;
+	double statsTime = get_time();
+	PacketHandle received[ReceiveBatchSize];
+
+	while (true)
 	{
-		const float RTT_Threshold = 250.0f;
+		if (!connected && network.IsConnected())
+		{
+			printf("client connected to server\n");
+			connected = true;
+		}
+
+		if (!connected && network.ConnectFailed())
+		{
+			printf("connection failed\n");
+			break;
+		}
+
+		// top up the send queue until the network thread pushes back
 
-		if (mode == Good)
+		bool waitingForDisk = false;
+		while (!network.IsSendBlocked() && network.GetSendSpace() > 0)
 		{
-			if (rtt > RTT_Threshold)
+			if (file.IsOpen())
 			{
-				printf("*** dropping to bad mode ***\n");
-				mode = Bad;
-				if (good_conditions_time < 10.0f && penalty_time < 60.0f)
+				if (fileOffset == file.GetSize())
+					break;
+				const int bytes = (int)std::min((long long)PacketSize, file.GetSize() - fileOffset);
+				file.ReadAhead(fileOffset);
+				if (!file.IsResident(fileOffset, bytes) && readAheadWaits < MaxReadAheadWaits)
 				{
-					penalty_time *= 2.0f;
-					if (penalty_time > 60.0f)
-						penalty_time = 60.0f;
-					printf("penalty time increased to %.1f\n", penalty_time);
+					file.Refetch(fileOffset);
+					readAheadWaits++;
+					waitingForDisk = true;
+					break;
 				}
-				good_conditions_time = 0.0f;
-				penalty_reduction_accumulator = 0.0f;
-				return;
+				readAheadWaits = 0;
+				if (!network.SendBorrowed(file.GetData() + fileOffset, bytes))
+					break;
+				fileOffset += bytes;
+				if (fileOffset == file.GetSize())
+					printf("all %lld bytes of %s queued\n", file.GetSize(), fileName);
+				continue;
 			}
 
-			good_conditions_time += deltaTime;
-			penalty_reduction_accumulator += deltaTime;
-
-			if (penalty_reduction_accumulator > 10.0f && penalty_time > 1.0f)
-			{
-				penalty_time /= 2.0f;
-				if (penalty_time < 1.0f)
-					penalty_time = 1.0f;
-				printf("penalty time reduced to %.1f\n", penalty_time);
-				penalty_reduction_accumulator = 0.0f;
-			}
+			const unsigned char newData[50] = "wahah wee";
+			PacketHandle packet = PacketHandle::Allocate(newData, sizeof(newData));
+			memset(packet.GetData() + sizeof(newData), 0, PacketSize - sizeof(newData));
+			packet.SetSize(PacketSize);
+			if (!network.Send(packet))
+				break;
 		}
 
-		if (mode == Bad)
+		int count = 0;
+		while ((count = network.Receive(received, ReceiveBatchSize)) > 0)
 		{
-			if (rtt <= RTT_Threshold)
-				good_conditions_time += deltaTime;
-			else
-				good_conditions_time = 0.0f;
+#ifdef SHOW_PACKETS
+			printf("%d packets recieved !\n", count);
+#endif
+		}
 
-			if (good_conditions_time > penalty_time)
-			{
-				printf("*** upgrading to good mode ***\n");
-				good_conditions_time = 0.0f;
-				penalty_reduction_accumulator = 0.0f;
-				mode = Good;
-				return;
-			}
+		if (get_time() - statsTime >= 0.25 && network.IsConnected())
+		{
+			const NetworkStats stats = network.GetStats();
+			printf("rtt %.1fms, sent %d, acked %d, lost %d (%.1f%%), sent bandwidth = %.1fkbps, acked bandwidth = %.1fkbps\n",
+				stats.rtt * 1000.0f, stats.sentPackets, stats.ackedPackets, stats.lostPackets,
+				stats.sentPackets > 0 ? (float)stats.lostPackets / (float)stats.sentPackets * 100.0f : 0.0f,
+				stats.sentBandwidth, stats.ackedBandwidth);
+			statsTime = get_time();
 		}
-	}
 
-	float GetSendRate()
-	{
-		return mode == Good ? 30.0f : 10.0f;
+		wait(waitingForDisk ? ReadAheadWait : MaxWaitTime);
 	}
 
-private:
-
-	enum Mode
-	{
-		Good,
-		Bad
-	};
-
-	Mode mode;
-	float penalty_time;
-	float good_conditions_time;
-	float penalty_reduction_accumulator;
-};
+	network.Stop();
+	return 0;
+}
 
-// ----------------------------------------------
+#endif
 
 int main(int argc, char* argv[])
 {
@@ -130,6 +164,7 @@ int main(int argc, char* argv[])
 
 	Mode mode = Server;
 	Address address;
+	const char* fileName = NULL;
 
 	// need to tweak this functionality to accept and parse the new set of parameters and their formats. 
 	// add a call to a FileOperations.cpp function that will open a file based upon the first
@@ -157,46 +192,61 @@ int main(int argc, char* argv[])
 	// FORMAT WILL BE AS FOLLOWS:
 	// ReliableUDP.exe [file] [IP] [port num.]
 
-	for (int i = 0; i <= argc; i++) {
+	for (int i = 1; i < argc; i++) {
 		//loop through args. skip the first.
-		switch (argc) {
-		case 1:
-			// program name.
-			break;
-		case 2:
+		switch (i) {
+		case 1: {
 			//filename.
-			char* fileName[FileNameLength];
 			//check for help switch.
-			if (strcmp(argv[2], "help")) {
+			if (strcmp(argv[1], "help") == 0) {
 				printf("ReliableUDP: Usage\n");
 				printf("	ReliableUDP [input file] [IP] [port num.]\n");
 				printf("	 - Switches should be in order, any invalid arguments will be set to defaults.\n");
+				return 0;
 			}
 			//assign fileName.
-#pragma warning (disable: 4996) 
-			strcpy(*fileName, argv[2]);
+			fileName = argv[1];
 			break;
-		case 3:
+		}
+		case 2: {
 			//IP.
 			int a, b, c, d;
 #pragma warning(suppress : 4996)
-			if (sscanf(argv[3], "%d.%d.%d.%d", &a, &b, &c, &d))
+			if (sscanf(argv[2], "%d.%d.%d.%d", &a, &b, &c, &d) == 4)
 			{
 				mode = Client;
+				address = Address((unsigned char)a, (unsigned char)b, (unsigned char)c, (unsigned char)d, ServerPort);
 			}
 			else {
 				//set default.
 			}
-		case 4:
+			break;
+		}
+		case 3:
 			//port.
-			if (atoi(argv[4]) != 0 ) {
-
+			if (atoi(argv[3]) != 0 ) {
+				address = Address(address.GetAddress(), (unsigned short)atoi(argv[3]));
 			}
 			break;
 		}
 
 	}
 
+	// map the file to send before opening a connection, so a missing file is reported straight away
+
+	MappedFile file;
+	long long fileOffset = 0;
+	int readAheadWaits = 0;
+	if (fileName)
+	{
+		if (!file.Open(fileName))
+		{
+			printf("could not open file %s\n", fileName);
+			return 1;
+		}
+		printf("sending %s (%lld bytes)\n", fileName, file.GetSize());
+	}
+
 	// before connection is opened, ensure that file exists and can be opened.
 	// also ensure that file is an appropriate format (ASCII/binary).
 	// (call to file open function, after checking file extension)
@@ -235,12 +285,25 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+#ifdef NET_IO_URING
+	if (!connection.GetSocket().EnableRing())
+		printf("io_uring unavailable, using plain socket calls\n");
+#endif
+
 
 	if (mode == Client)
 		connection.Connect(address);
 	else
 		connection.Listen();
 
+#ifdef NETWORK_THREAD
+	CubicCongestionControl threadCongestionControl;
+	connection.SetCongestionControl(&threadCongestionControl);
+	const int result = RunNetworkThread(connection, file, fileName);
+	ShutdownSockets();
+	return result;
+#endif
+
 	//
 	// After client side has recieved validation for a compatible file, 
 	// confirmation of file metadata will be sent in the form of a packet.
@@ -253,27 +316,46 @@ int main(int argc, char* argv[])
 	// The metadata should probably be retrieved before anything substantial occurs.
 	//
 
+	// sleep in the reactor between packets and deadlines instead of spinning
+
+	Reactor reactor;
+	if (!reactor.Open() || !reactor.Add(connection.GetSocket()))
+	{
+		printf("could not start reactor\n");
+		return 1;
+	}
+
 	bool connected = false;
-	float sendAccumulator = 0.0f;
+	Pacer pacer;
+	double previousTime = get_time();
+	pacer.Reset(previousTime);
 	float statsAccumulator = 0.0f;
 
-	FlowControl flowControl;
+	CubicCongestionControl congestionControl;
+	connection.SetCongestionControl(&congestionControl);
+
+	static unsigned char receiveBuffers[ReceiveBatchSize][PacketSize];
+	Datagram receivePackets[ReceiveBatchSize];
+	for (int i = 0; i < ReceiveBatchSize; ++i)
+		receivePackets[i].data = receiveBuffers[i];
 
 	while (true)
 	{
-		// update flow control
+		// advance by the real time since the last pass
 
-		if (connection.IsConnected())
-			flowControl.Update(DeltaTime, connection.GetReliabilitySystem().GetRoundTripTime() * 1000.0f);
+		const double currentTime = get_time();
+		const float deltaTime = (float)(currentTime - previousTime);
+		previousTime = currentTime;
 
-		const float sendRate = flowControl.GetSendRate();
+		// pace sends at the congestion control rate on the monotonic clock
+
+		pacer.SetRate(connection.GetReliabilitySystem().GetPacingRate());
 
 		// detect changes in connection state
 
 		if (mode == Server && connected && !connection.IsConnected())
 		{
-			flowControl.Reset();
-			printf("reset flow control\n");
+			printf("reset congestion control\n");
 			connected = false;
 		}
 
@@ -304,18 +386,60 @@ int main(int argc, char* argv[])
 		//  - **if an error is found in the current chunk the entire chunk should be retransmitted.**
 		//
 
-		sendAccumulator += DeltaTime;
+		const int packetBytes = PacketSize + connection.GetHeaderSize();
+		bool waitingForDisk = false;
+
+		// lost payloads go first, out of the same pacer budget as new ones
+
+		pacer.OnSent(connection.SendResends(pacer.GetBudget(get_time())));
 
-		while (sendAccumulator > 1.0f / sendRate)
+		while (pacer.CanSend(get_time(), packetBytes) && connection.CanSendPacket(PacketSize))
 		{
+			// stream the file: each payload is sent straight out of the mapped pages, and only copied if it is lost.
+			// if read-ahead has not brought the next chunk in yet, ask again and come back shortly rather than fault it
+			// in from disk in the middle of the loop, up to MaxReadAheadWaits times in a row so the stream keeps moving
+
+			if (file.IsOpen())
+			{
+				if (fileOffset == file.GetSize())
+					break;
+				const int bytes = (int)std::min((long long)PacketSize, file.GetSize() - fileOffset);
+				file.ReadAhead(fileOffset);
+				if (!file.IsResident(fileOffset, bytes) && readAheadWaits < MaxReadAheadWaits)
+				{
+					file.Refetch(fileOffset);
+					readAheadWaits++;
+					waitingForDisk = true;
+					break;
+				}
+				readAheadWaits = 0;
+				if (!connection.SendBorrowedPacket(file.GetData() + fileOffset, bytes))
+					break;
+				fileOffset += bytes;
+				pacer.OnSent(packetBytes);
+				if (fileOffset == file.GetSize())
+					printf("all %lld bytes of %s sent\n", file.GetSize(), fileName);
+				continue;
+			}
+
 			int count = 0;
 			unsigned char packet[PacketSize];
 			const unsigned char newData[50] = "wahah wee";
 			memcpy(packet, newData, 50);
 			//memset(packet, 0, sizeof(packet));
 			connection.SendPacket(packet, sizeof(packet), count);
-			sendAccumulator -= 1.0f / sendRate;
-			printf("% s", "packet sent !");
+			pacer.OnSent(packetBytes);
+#ifdef SHOW_PACKETS
+			printf("packet sent !\n");
+#endif
+		}
+
+		// the pages behind the oldest chunk still waiting for its ack are no longer needed
+
+		if (file.IsOpen())
+		{
+			const unsigned char* lowest = connection.GetLowestBorrowed();
+			file.Release(lowest ? lowest - file.GetData() : fileOffset);
 		}
 
 
@@ -328,14 +452,18 @@ int main(int argc, char* argv[])
 		// without error. once an entire chunk is recieved, checking should be done to reduce 
 		// overhead (before doing a full-file check).
 		//
-		while (true)
-		{
-			unsigned char packet[256];
-			int bytes_read = connection.ReceivePacket(packet, sizeof(packet), packet);
-			if (bytes_read == 0)
-				printf("% s", "packet recieved !");
-				break;
-		}
+		// drain the socket a batch at a time so one wakeup handles everything that arrived this frame
+		//  + keep going until the socket is empty, a batch of nothing but acks accepts no payloads
+
+		int received = 0;
+		int datagrams = 0;
+		do
+			received += connection.ReceivePackets(receivePackets, ReceiveBatchSize, PacketSize, &datagrams);
+		while (datagrams > 0);
+#ifdef SHOW_PACKETS
+		if (received > 0)
+			printf("%d packets recieved !\n", received);
+#endif
 
 		// show packets that were acked this frame
 
@@ -362,11 +490,11 @@ int main(int argc, char* argv[])
 
 		// update connection
 
-		connection.Update(DeltaTime);
+		connection.Update(deltaTime);
 
 		// show connection stats
 
-		statsAccumulator += DeltaTime;
+		statsAccumulator += deltaTime;
 
 		while (statsAccumulator >= 0.25f && connection.IsConnected())
 		{
@@ -387,7 +515,17 @@ int main(int argc, char* argv[])
 			statsAccumulator -= 0.25f;
 		}
 
-		//net::wait(DeltaTime);
+		// wait for packets or the next deadline: the connection timers, the next paced send if the window is open, and stats
+
+		const double waitTime = get_time();
+		float timeout = std::min(MaxWaitTime, connection.GetTimeUntilNextUpdate());
+		if (connection.CanSendPacket(PacketSize))
+			timeout = std::min(timeout, (float)(pacer.GetNextSendTime(waitTime, packetBytes) - waitTime));
+		if (connection.IsConnected())
+			timeout = std::min(timeout, 0.25f - statsAccumulator);
+		if (waitingForDisk)
+			timeout = std::min(timeout, ReadAheadWait);
+		reactor.Wait(timeout);
 	}
 	//
 	// before shutdown, check back with our progress function and see if the entire file has been transmited 